@@ -38,6 +38,8 @@
 #include "diag_cntl.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "peripheral.h"
+#include "presets.h"
 #include "util.h"
 
 #define DIAG_CMD_KEEP_ALIVE_SUBSYS	50
@@ -55,6 +57,7 @@
 
 #define DIAG_CMD_DIAG_SUBSYS	18
 #define DIAG_CMD_DIAG_GET_DIAG_ID	0x222
+#define DIAG_CMD_DIAG_SET_PRESET_ID	0x230
 
 static int handle_diag_version(struct diag_client *client, const void *buf,
 			       size_t len)
@@ -163,6 +166,45 @@ static int handle_diag_id(struct diag_client *client, const void *buf, size_t le
 	return dm_send(client, resp_buffer, resp_len);
 }
 
+/*
+ * Switch the peripherals supporting mask presets to the given preset; the
+ * router's masks, as reported by GET_*_MASK and used for the other
+ * peripherals, are left as they are
+ */
+static int handle_set_preset_id(struct diag_client *client, const void *buf,
+				size_t len)
+{
+	struct {
+		uint8_t cmd_code;
+		uint8_t subsys_id;
+		uint16_t subsys_cmd_code;
+		uint8_t preset_id;
+	} __packed *req = (void *)buf;
+	struct {
+		uint8_t cmd_code;
+		uint8_t subsys_id;
+		uint16_t subsys_cmd_code;
+		uint8_t preset_id;
+		uint8_t status;
+	} __packed resp;
+
+	if (len < sizeof(*req))
+		return -EMSGSIZE;
+
+	resp.cmd_code = req->cmd_code;
+	resp.subsys_id = req->subsys_id;
+	resp.subsys_cmd_code = req->subsys_cmd_code;
+	resp.preset_id = req->preset_id;
+	resp.status = 0;
+
+	if (diag_preset_select(req->preset_id) < 0)
+		resp.status = 1;
+	else
+		peripheral_broadcast_preset(req->preset_id);
+
+	return dm_send(client, &resp, sizeof(resp));
+}
+
 void register_app_cmds(void)
 {
 	register_fallback_cmd(DIAG_CMD_DIAG_VERSION_ID, handle_diag_version);
@@ -172,4 +214,7 @@ void register_app_cmds(void)
 				     DIAG_CMD_KEEP_ALIVE_CMD, handle_keep_alive);
 	register_fallback_subsys_cmd(DIAG_CMD_DIAG_SUBSYS,
 				     DIAG_CMD_DIAG_GET_DIAG_ID, handle_diag_id);
+	register_fallback_subsys_cmd(DIAG_CMD_DIAG_SUBSYS,
+				     DIAG_CMD_DIAG_SET_PRESET_ID,
+				     handle_set_preset_id);
 }
@@ -29,34 +29,158 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* for memfd_create() */
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "circ_buf.h"
 
+/*
+ * Map a memfd twice, back to back, so that data wrapping around the end of
+ * the buffer can still be accessed contiguously.
+ */
+static char *circ_map_mirrored(size_t size)
+{
+	char *base;
+	char *ptr;
+	int fd;
+
+	fd = memfd_create("circ_buf", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) < 0)
+		goto err_close;
+
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+		    -1, 0);
+	if (base == MAP_FAILED)
+		goto err_close;
+
+	ptr = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		   fd, 0);
+	if (ptr == MAP_FAILED)
+		goto err_unmap;
+
+	ptr = mmap(base + size, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_FIXED, fd, 0);
+	if (ptr == MAP_FAILED)
+		goto err_unmap;
+
+	close(fd);
+
+	return base;
+
+err_unmap:
+	munmap(base, 2 * size);
+err_close:
+	close(fd);
+
+	return NULL;
+}
+
+/**
+ * circ_init() - allocate the storage of a circular buffer
+ * @buf:	circ_buf object to initialize
+ * @size:	requested size, rounded up to a power of two of at least a page
+ *
+ * The storage is mapped twice where possible, falling back to a plain
+ * allocation, where readers need to handle the wrap around themselves.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+int circ_init(struct circ_buf *buf, size_t size)
+{
+	size_t actual = sysconf(_SC_PAGESIZE);
+
+	while (actual < size)
+		actual <<= 1;
+
+	memset(buf, 0, sizeof(*buf));
+	buf->size = actual;
+
+	buf->buf = circ_map_mirrored(actual);
+	if (buf->buf) {
+		buf->mirrored = true;
+		return 0;
+	}
+
+	buf->buf = malloc(actual);
+	if (!buf->buf)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void circ_free(struct circ_buf *buf)
+{
+	if (buf->mirrored)
+		munmap(buf->buf, 2 * buf->size);
+	else
+		free(buf->buf);
+
+	buf->buf = NULL;
+}
+
+/* Describe the free space of @buf, returning the number of iovecs used */
+static int circ_space_iov(struct circ_buf *buf, struct iovec *iov)
+{
+	size_t space = CIRC_SPACE(buf);
+	size_t to_end;
+
+	iov[0].iov_base = buf->buf + buf->head;
+
+	if (buf->mirrored) {
+		iov[0].iov_len = space;
+		return 1;
+	}
+
+	to_end = MIN(space, buf->size - buf->head);
+	iov[0].iov_len = to_end;
+	if (to_end == space)
+		return 1;
+
+	iov[1].iov_base = buf->buf;
+	iov[1].iov_len = space - to_end;
+
+	return 2;
+}
+
 /**
  * circ_read() - read data into circular buffer
  * @fd:		non-blocking file descriptor to read
  * @buf:	circ_buf object to write to
  *
+ * Each read covers all the free space in @buf.
+ *
  * Return: 0 if fifo is full or fd depleted, negative errno on failure
  */
 ssize_t circ_read(int fd, struct circ_buf *buf)
 {
+	struct iovec iov[2];
 	size_t space;
 	ssize_t n;
+	int cnt;
 
 	do {
-		space = CIRC_SPACE_TO_END(buf);
+		space = CIRC_SPACE(buf);
 		if (!space)
 			return 0;
 
-		n = read(fd, buf->buf + buf->head, space);
+		cnt = circ_space_iov(buf, iov);
+
+		n = readv(fd, iov, cnt);
 		if (n < 0)
 			return n;
 
-		buf->head = (buf->head + n) & (HDLC_BUF_SIZE - 1);
-	} while (n == space);
+		buf->head = (buf->head + n) & (buf->size - 1);
+	} while ((size_t)n == space);
 
 	return 0;
 }
@@ -31,20 +31,39 @@
 #ifndef __CIRC_BUF_H__
 #define __CIRC_BUF_H__
 
-#include "util.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
-#define HDLC_BUF_SIZE 16384
+#include "util.h"
 
+/**
+ * struct circ_buf - circular buffer
+ * @buf:	storage, where possible mapped twice back to back, so that
+ *		@buf[i] and @buf[i + @size] alias and data is always contiguous
+ * @size:	size of @buf, a power of two
+ * @head:	offset where the next data is written
+ * @tail:	offset of the oldest data
+ * @mirrored:	@buf is mapped twice
+ */
 struct circ_buf {
-	char buf[HDLC_BUF_SIZE];
+	char *buf;
+	size_t size;
 	size_t head;
 	size_t tail;
+	bool mirrored;
 };
 
-#define CIRC_SPACE(buf) (((buf)->tail - (buf)->head - 1) & (HDLC_BUF_SIZE - 1))
+#define CIRC_CNT(buf) (((buf)->head - (buf)->tail) & ((buf)->size - 1))
+
+#define CIRC_SPACE(buf) (((buf)->tail - (buf)->head - 1) & ((buf)->size - 1))
 
-#define CIRC_SPACE_TO_END(buf) MIN(CIRC_SPACE(buf), HDLC_BUF_SIZE - (buf)->head)
+/* Amount of data readable at @buf->tail without wrapping */
+#define CIRC_CNT_TO_END(buf) ((buf)->mirrored ? CIRC_CNT(buf) : \
+			      MIN(CIRC_CNT(buf), (buf)->size - (buf)->tail))
 
+int circ_init(struct circ_buf *buf, size_t size);
+void circ_free(struct circ_buf *buf);
 ssize_t circ_read(int fd, struct circ_buf *buf);
 
 #endif
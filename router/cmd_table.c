@@ -0,0 +1,342 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmd_table.h"
+#include "diag.h"
+
+/*
+ * Commands are kept in an array sorted by range, which makes duplicate
+ * registrations easy to spot. Lookups go through an index splitting the key
+ * space into segments, at every first key and every key following a last key
+ * of the ranges, each segment listing the commands covering all of its keys.
+ * A lookup is then a binary search for the segment of the key.
+ *
+ * The index is rebuilt on the first lookup following changes, so a burst of
+ * registrations costs a single rebuild.
+ */
+
+static int cmd_compare(const struct diag_cmd *a, const struct diag_cmd *b)
+{
+	if (a->first != b->first)
+		return a->first < b->first ? -1 : 1;
+	if (a->last != b->last)
+		return a->last < b->last ? -1 : 1;
+	if (a->peripheral != b->peripheral)
+		return (uintptr_t)a->peripheral < (uintptr_t)b->peripheral ? -1 : 1;
+	if (a->cb != b->cb)
+		return (uintptr_t)a->cb < (uintptr_t)b->cb ? -1 : 1;
+
+	return 0;
+}
+
+/* Return the index of the first command not ordered before @dc */
+static size_t cmd_table_search(struct cmd_table *table,
+			       const struct diag_cmd *dc)
+{
+	size_t lo = 0;
+	size_t hi = table->count;
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmd_compare(table->cmds[mid], dc) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void *cmd_table_grow(void *ptr, size_t *size, size_t needed,
+			    size_t elem_size)
+{
+	size_t new_size = *size ? *size : 16;
+
+	if (needed <= *size)
+		return ptr;
+
+	while (new_size < needed)
+		new_size *= 2;
+
+	ptr = realloc(ptr, new_size * elem_size);
+	if (!ptr)
+		err(1, "failed to grow command table");
+
+	*size = new_size;
+
+	return ptr;
+}
+
+/**
+ * cmd_table_add() - register a command key range
+ * @table:	command table
+ * @first:	first key of the range
+ * @last:	last key of the range
+ * @peripheral:	peripheral to forward the commands to, or NULL
+ * @cb:		handler of the commands, or NULL
+ *
+ * Return: 0 on success, -EEXIST if the same registration already exists
+ */
+int cmd_table_add(struct cmd_table *table, unsigned int first,
+		  unsigned int last, struct peripheral *peripheral,
+		  int (*cb)(struct diag_client *, const void *, size_t))
+{
+	struct diag_cmd key = {
+		.first = first,
+		.last = last,
+		.peripheral = peripheral,
+		.cb = cb,
+	};
+	struct diag_cmd *dc;
+	size_t idx;
+
+	idx = cmd_table_search(table, &key);
+	if (idx < table->count && !cmd_compare(table->cmds[idx], &key))
+		return -EEXIST;
+
+	dc = malloc(sizeof(*dc));
+	if (!dc)
+		err(1, "failed to allocate diag command");
+
+	*dc = key;
+
+	table->cmds = cmd_table_grow(table->cmds, &table->size,
+				     table->count + 1, sizeof(*table->cmds));
+	memmove(&table->cmds[idx + 1], &table->cmds[idx],
+		(table->count - idx) * sizeof(*table->cmds));
+	table->cmds[idx] = dc;
+	table->count++;
+
+	table->dirty = true;
+
+	return 0;
+}
+
+/*
+ * The index, and so a dispatch in progress, may still reference the command,
+ * so it's released with the index; clearing it makes the dispatch skip it.
+ */
+static void cmd_table_remove_idx(struct cmd_table *table, size_t idx)
+{
+	struct diag_cmd *dc = table->cmds[idx];
+
+	dc->peripheral = NULL;
+	dc->cb = NULL;
+
+	table->dead = cmd_table_grow(table->dead, &table->dead_size,
+				     table->dead_count + 1,
+				     sizeof(*table->dead));
+	table->dead[table->dead_count++] = dc;
+
+	memmove(&table->cmds[idx], &table->cmds[idx + 1],
+		(table->count - idx - 1) * sizeof(*table->cmds));
+	table->count--;
+
+	table->dirty = true;
+}
+
+/**
+ * cmd_table_remove() - remove the registrations of a range by a peripheral
+ * @table:	command table
+ * @first:	first key of the range
+ * @last:	last key of the range
+ * @peripheral:	peripheral which registered the range
+ */
+void cmd_table_remove(struct cmd_table *table, unsigned int first,
+		      unsigned int last, struct peripheral *peripheral)
+{
+	size_t i;
+
+	i = cmd_table_search(table, &(struct diag_cmd){ .first = first,
+							.last = last });
+	while (i < table->count && table->cmds[i]->first == first &&
+	       table->cmds[i]->last == last) {
+		if (table->cmds[i]->peripheral == peripheral)
+			cmd_table_remove_idx(table, i);
+		else
+			i++;
+	}
+}
+
+/**
+ * cmd_table_remove_peripheral() - remove all registrations of a peripheral
+ * @table:	command table
+ * @peripheral:	peripheral going away
+ */
+void cmd_table_remove_peripheral(struct cmd_table *table,
+				 struct peripheral *peripheral)
+{
+	size_t i = 0;
+
+	while (i < table->count) {
+		if (table->cmds[i]->peripheral == peripheral)
+			cmd_table_remove_idx(table, i);
+		else
+			i++;
+	}
+}
+
+static int cmd_bound_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void cmd_table_rebuild(struct cmd_table *table)
+{
+	struct diag_cmd **active = NULL;
+	size_t active_size = 0;
+	size_t cmds_size = 0;
+	size_t nactive = 0;
+	size_t nbounds = 0;
+	size_t total = 0;
+	uint64_t *bounds;
+	size_t next = 0;
+	size_t i;
+	size_t j;
+
+	/* Segments start at each first key and after each last key */
+	bounds = malloc((2 * table->count + 1) * sizeof(*bounds));
+	if (!bounds)
+		err(1, "failed to allocate command table bounds");
+
+	for (i = 0; i < table->count; i++) {
+		bounds[nbounds++] = table->cmds[i]->first;
+		bounds[nbounds++] = (uint64_t)table->cmds[i]->last + 1;
+	}
+
+	qsort(bounds, nbounds, sizeof(*bounds), cmd_bound_compare);
+
+	free(table->seg_first);
+	free(table->seg_offset);
+	free(table->seg_cmds);
+	table->seg_cmds = NULL;
+	table->seg_first = malloc(nbounds * sizeof(*table->seg_first));
+	table->seg_offset = malloc((nbounds + 1) * sizeof(*table->seg_offset));
+	if (!table->seg_first || !table->seg_offset)
+		err(1, "failed to allocate command table index");
+
+	table->seg_count = 0;
+	for (i = 0; i < nbounds; i++) {
+		if (i && bounds[i] == bounds[i - 1])
+			continue;
+
+		/* Keys following the last possible key need no segment */
+		if (bounds[i] > UINT32_MAX)
+			break;
+
+		/* @cmds is sorted by first key, so commands enter in order */
+		while (next < table->count &&
+		       table->cmds[next]->first == bounds[i]) {
+			active = cmd_table_grow(active, &active_size,
+						nactive + 1, sizeof(*active));
+			active[nactive++] = table->cmds[next++];
+		}
+
+		for (j = 0; j < nactive;) {
+			if (active[j]->last < bounds[i])
+				active[j] = active[--nactive];
+			else
+				j++;
+		}
+
+		table->seg_cmds = cmd_table_grow(table->seg_cmds, &cmds_size,
+						 total + nactive,
+						 sizeof(*table->seg_cmds));
+
+		table->seg_first[table->seg_count] = bounds[i];
+		table->seg_offset[table->seg_count] = total;
+		table->seg_count++;
+
+		memcpy(&table->seg_cmds[total], active,
+		       nactive * sizeof(*active));
+		total += nactive;
+	}
+
+	if (table->seg_count)
+		table->seg_offset[table->seg_count] = total;
+
+	free(active);
+	free(bounds);
+
+	for (i = 0; i < table->dead_count; i++)
+		free(table->dead[i]);
+	table->dead_count = 0;
+
+	table->dirty = false;
+}
+
+/**
+ * cmd_table_lookup() - find the commands covering a key
+ * @table:	command table
+ * @key:	command key
+ * @cmds:	set to the array of commands covering @key
+ *
+ * The returned array remains valid until the next lookup; entries removed
+ * in the meantime have both peripheral and cb cleared.
+ *
+ * Return: number of commands covering @key
+ */
+size_t cmd_table_lookup(struct cmd_table *table, unsigned int key,
+			struct diag_cmd ***cmds)
+{
+	size_t lo = 0;
+	size_t hi;
+	size_t mid;
+
+	if (table->dirty)
+		cmd_table_rebuild(table);
+
+	/* Find the last segment starting at or before @key */
+	hi = table->seg_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (table->seg_first[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return 0;
+
+	*cmds = &table->seg_cmds[table->seg_offset[lo - 1]];
+
+	return table->seg_offset[lo] - table->seg_offset[lo - 1];
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __CMD_TABLE_H__
+#define __CMD_TABLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct diag_client;
+struct diag_cmd;
+struct peripheral;
+
+/**
+ * struct cmd_table - set of command key ranges, indexed for lookup
+ * @cmds:	registered commands, sorted and without duplicates
+ * @count:	number of entries in @cmds
+ * @size:	allocated size of @cmds
+ * @dead:	removed commands, possibly still referenced by the index
+ * @dead_count:	number of entries in @dead
+ * @dead_size:	allocated size of @dead
+ * @seg_first:	first key of each segment of keys covered by the same commands
+ * @seg_offset:	index in @seg_cmds of the commands covering each segment
+ * @seg_cmds:	commands covering each segment, back to back
+ * @seg_count:	number of segments
+ * @dirty:	the index is out of date with @cmds
+ */
+struct cmd_table {
+	struct diag_cmd **cmds;
+	size_t count;
+	size_t size;
+
+	struct diag_cmd **dead;
+	size_t dead_count;
+	size_t dead_size;
+
+	unsigned int *seg_first;
+	size_t *seg_offset;
+	struct diag_cmd **seg_cmds;
+	size_t seg_count;
+	bool dirty;
+};
+
+int cmd_table_add(struct cmd_table *table, unsigned int first,
+		  unsigned int last, struct peripheral *peripheral,
+		  int (*cb)(struct diag_client *, const void *, size_t));
+void cmd_table_remove(struct cmd_table *table, unsigned int first,
+		      unsigned int last, struct peripheral *peripheral);
+void cmd_table_remove_peripheral(struct cmd_table *table,
+				 struct peripheral *peripheral);
+size_t cmd_table_lookup(struct cmd_table *table, unsigned int key,
+			struct diag_cmd ***cmds);
+
+#endif
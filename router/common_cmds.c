@@ -38,6 +38,7 @@
 #include "dm.h"
 #include "hdlc.h"
 #include "masks.h"
+#include "mbuf.h"
 #include "peripheral.h"
 #include "util.h"
 
@@ -120,85 +121,82 @@ static int handle_logging_configuration(struct diag_client *client,
 		break;
 	}
 	case DIAG_CMD_OP_SET_LOG_MASK: {
-		struct diag_log_cmd_mask *mask_to_set = (struct diag_log_cmd_mask*)(buf + sizeof(struct diag_log_cmd_header));
+		const struct diag_log_cmd_mask *mask_to_set = buf + sizeof(struct diag_log_cmd_header);
 		struct {
 			struct diag_log_cmd_header header;
 			uint32_t status;
 			struct diag_log_cmd_mask mask_structure;
 		} __packed *resp;
-		uint32_t resp_size = sizeof(*resp);
-		uint32_t mask_size = sizeof(*mask_to_set) + BITS_TO_BYTES(mask_to_set->num_items);
 		uint32_t num_items;
+		uint32_t mask_size;
+		struct mbuf *mbuf;
+		int ret;
 
-		if (sizeof(*request_header) + mask_size != len)
+		if (len < sizeof(*request_header) + sizeof(*mask_to_set))
 			return -EMSGSIZE;
 
-		resp_size += mask_size;
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
-		memcpy(resp, request_header, sizeof(*request_header));
+		/* Sized in size_t, as num_items close to UINT32_MAX would wrap */
 		num_items = mask_to_set->num_items;
-		diag_cmd_set_log_mask(mask_to_set->equip_id, &num_items, mask_to_set->mask, &mask_size);
-		mask_to_set->num_items = num_items;
-		memcpy(&resp->mask_structure, mask_to_set, mask_size); // num_items might have been capped!!!
-		resp->status = DIAG_CMD_STATUS_SUCCESS;
+		if (sizeof(*request_header) + sizeof(*mask_to_set) +
+		    BITS_TO_BYTES((size_t)num_items) != len)
+			return -EMSGSIZE;
 
-		peripheral_broadcast_log_mask(resp->mask_structure.equip_id);
+		ret = diag_cmd_set_log_mask(mask_to_set->equip_id, &num_items,
+					    mask_to_set->mask, &mask_size);
+		if (ret)
+			mask_size = 0;
+		else
+			peripheral_broadcast_log_mask(mask_to_set->equip_id);
+
+		/* num_items, and so the mask echoed back, might have been capped */
+		mbuf = dm_response_alloc(sizeof(*resp) + mask_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
+		memcpy(resp, request_header, sizeof(*request_header));
+		resp->mask_structure.equip_id = mask_to_set->equip_id;
+		resp->mask_structure.num_items = num_items;
+		memcpy(resp->mask_structure.mask, mask_to_set->mask, mask_size);
+		resp->status = ret ? DIAG_CMD_STATUS_INVALID_EQUIPMENT_ID :
+				     DIAG_CMD_STATUS_SUCCESS;
 
-		dm_send(client, resp, resp_size);
-		free(resp);
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
 	case DIAG_CMD_OP_GET_LOG_MASK: {
-		uint32_t *equip_id = (uint32_t *)(buf + sizeof(struct diag_log_cmd_header));
+		const uint32_t *equip_id = buf + sizeof(struct diag_log_cmd_header);
 		struct get_log_response_resp {
 			struct diag_log_cmd_header header;
 			uint32_t status;
 			struct diag_log_cmd_mask mask_structure;
 		} __packed *resp;
 		uint32_t num_items = 0;
-		uint8_t *mask;
+		const uint8_t *mask;
 		uint32_t mask_size = 0;
-		uint32_t resp_size = sizeof(*resp);
+		struct mbuf *mbuf;
+		int ret;
 
 		if (sizeof(*request_header) + sizeof(*equip_id) != len)
 			return -EMSGSIZE;
 
-		if (diag_cmd_get_log_mask(*equip_id, &num_items, &mask, &mask_size) == 0) {
-			resp_size += mask_size;
-			resp = malloc(resp_size);
-			if (!resp) {
-				warn("Failed to allocate response packet\n");
-				return -errno;
-			}
-			memcpy(resp, request_header, sizeof(*request_header));
-			resp->mask_structure.equip_id = *equip_id;
-			resp->mask_structure.num_items = num_items;
-			if (mask != NULL) {
-				memcpy(&resp->mask_structure.mask, mask, mask_size);
-				free(mask);
-			}
-			resp->status = DIAG_CMD_STATUS_SUCCESS;
-		} else {
-			resp = malloc(resp_size);
-			if (!resp) {
-				warn("Failed to allocate response packet\n");
-				return -errno;
-			}
-			memcpy(resp, request_header, sizeof(*request_header));
-			resp->mask_structure.equip_id = *equip_id;
-			resp->mask_structure.num_items = num_items;
-			resp->status = DIAG_CMD_STATUS_INVALID_EQUIPMENT_ID;
-		}
+		ret = diag_cmd_get_log_mask(*equip_id, &num_items, &mask, &mask_size);
+		if (ret)
+			mask_size = 0;
 
-		peripheral_broadcast_log_mask(resp->mask_structure.equip_id);
+		mbuf = dm_response_alloc(sizeof(*resp) + mask_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
+		memcpy(resp, request_header, sizeof(*request_header));
+		resp->mask_structure.equip_id = *equip_id;
+		resp->mask_structure.num_items = num_items;
+		if (!ret)
+			memcpy(resp->mask_structure.mask, mask, mask_size);
+		resp->status = ret ? DIAG_CMD_STATUS_INVALID_EQUIPMENT_ID :
+				     DIAG_CMD_STATUS_SUCCESS;
 
-		dm_send(client, resp, resp_size);
-		free(resp);
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
@@ -227,32 +225,23 @@ static int handle_extended_message_configuration(struct diag_client *client,
 			uint32_t range_cnt;
 			struct diag_ssid_range_t ranges[];
 		} __packed *resp;
-		uint32_t resp_size = sizeof(*resp);
-		uint32_t count = 0;
-		struct diag_ssid_range_t *ranges = NULL;
-		uint32_t ranges_size = 0;
+		uint32_t ranges_size = MSG_MASK_TBL_CNT * sizeof(resp->ranges[0]);
+		struct mbuf *mbuf;
 
 		if (sizeof(*request_header) != len)
 			return -EMSGSIZE;
 
-		diag_cmd_get_ssid_range(&count, &ranges);
-		ranges_size = count * sizeof(*ranges);
-		resp_size += ranges_size;
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
+		mbuf = dm_response_alloc(sizeof(*resp) + ranges_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
 		memcpy(resp, request_header, sizeof(*request_header));
-		resp->range_cnt = count;
-		if (ranges != NULL) {
-			memcpy(resp->ranges, ranges, ranges_size);
-			free(ranges);
-		}
 		resp->status = DIAG_CMD_MSG_STATUS_SUCCESSFUL;
+		resp->reserved = 0;
+		resp->range_cnt = MSG_MASK_TBL_CNT;
+		diag_cmd_get_ssid_range(resp->ranges, MSG_MASK_TBL_CNT);
 
-		dm_send(client, resp, resp_size);
-		free(resp);
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
@@ -266,40 +255,36 @@ static int handle_extended_message_configuration(struct diag_client *client,
 			uint8_t reserved;
 			uint32_t masks[];
 		} __packed *resp;
-		uint32_t resp_size = sizeof(*resp);
-		uint32_t *masks;
-		uint32_t masks_size;
+		const uint32_t *masks;
+		uint32_t masks_size = 0;
+		struct mbuf *mbuf;
+		int ret;
 
 		if (sizeof(*request_header) + sizeof(range) != len)
 			return -EMSGSIZE;
 
 		memcpy(&range, buf + sizeof(struct diag_msg_cmd_header), sizeof(range));
 
-		if (diag_cmd_get_build_mask(&range, &masks) == 0) {
+		ret = diag_cmd_get_build_mask(&range, &masks);
+		if (!ret)
 			masks_size = MSG_RANGE_TO_SIZE(range);
-			resp_size += masks_size;
-
-			resp = alloca(resp_size);
-			memset(resp, 0, resp_size);
-			resp->cmd = DIAG_CMD_EXTENDED_MESSAGE_CONFIGURATION;
-			resp->subcmd = DIAG_CMD_OP_GET_BUILD_MASK;
-
-			resp->range.ssid_first = range.ssid_first;
-			resp->range.ssid_last = range.ssid_last;
-
-			resp->status = DIAG_CMD_MSG_STATUS_SUCCESSFUL;
+		else
+			range.ssid_first = range.ssid_last = 0;
+
+		mbuf = dm_response_alloc(sizeof(*resp) + masks_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
+		resp->cmd = DIAG_CMD_EXTENDED_MESSAGE_CONFIGURATION;
+		resp->subcmd = DIAG_CMD_OP_GET_BUILD_MASK;
+		resp->range = range;
+		resp->status = ret ? DIAG_CMD_MSG_STATUS_UNSUCCESSFUL :
+				     DIAG_CMD_MSG_STATUS_SUCCESSFUL;
+		resp->reserved = 0;
+		if (!ret)
 			memcpy(resp->masks, masks, masks_size);
 
-			free(masks);
-		} else {
-			resp = alloca(resp_size);
-			memset(resp, 0, resp_size);
-			resp->cmd = DIAG_CMD_EXTENDED_MESSAGE_CONFIGURATION;
-			resp->subcmd = DIAG_CMD_OP_GET_BUILD_MASK;
-			resp->status = DIAG_CMD_MSG_STATUS_UNSUCCESSFUL;
-		}
-
-		dm_send(client, resp, resp_size);
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
@@ -311,35 +296,32 @@ static int handle_extended_message_configuration(struct diag_client *client,
 			uint8_t rsvd;
 			uint32_t rt_masks[];
 		} __packed *resp;
-		uint32_t resp_size = sizeof(*resp);
-		uint32_t *masks = NULL;
+		const uint32_t *masks;
 		uint32_t masks_size = 0;
+		struct mbuf *mbuf;
+		int ret;
 
 		if (sizeof(*request_header) + sizeof(range) != len)
 			return -EMSGSIZE;
 
 		memcpy(&range, buf + sizeof(struct diag_msg_cmd_header), sizeof(range));
 
-		if (diag_cmd_get_msg_mask(&range, &masks) == 0) {
+		ret = diag_cmd_get_msg_mask(&range, &masks);
+		if (!ret)
 			masks_size = MSG_RANGE_TO_SIZE(range);
-			resp_size += masks_size;
 
-			resp = alloca(resp_size);
-			memset(resp, 0, resp_size);
-
-			memcpy(resp, request_header, sizeof(*request_header));
+		mbuf = dm_response_alloc(sizeof(*resp) + masks_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
+		memcpy(resp, request_header, sizeof(*request_header));
+		resp->status = ret ? DIAG_CMD_MSG_STATUS_UNSUCCESSFUL :
+				     DIAG_CMD_MSG_STATUS_SUCCESSFUL;
+		resp->rsvd = 0;
+		if (!ret)
 			memcpy(resp->rt_masks, masks, masks_size);
-			resp->status = DIAG_CMD_MSG_STATUS_SUCCESSFUL;
-		} else {
-			resp = alloca(resp_size);
-			memset(resp, 0, resp_size);
-
-			memcpy(resp, request_header, sizeof(*request_header));
-			resp->status = DIAG_CMD_MSG_STATUS_UNSUCCESSFUL;
-		}
 
-		dm_send(client, resp, resp_size);
-		free(masks);
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
@@ -357,40 +339,34 @@ static int handle_extended_message_configuration(struct diag_client *client,
 			uint8_t rsvd;
 			uint32_t rt_masks[0];
 		} __packed *resp;
-		uint32_t resp_size = sizeof(*resp);
 		uint32_t masks_size = MSG_RANGE_TO_SIZE(req->range);
+		struct diag_ssid_range_t range;
+		struct mbuf *mbuf;
+		int ret;
 
 		if (sizeof(*req) + masks_size != len)
 			return -EMSGSIZE;
 
-		if (diag_cmd_set_msg_mask(req->range, req->masks) == 0) {
-			resp_size += masks_size;
-			resp = malloc(resp_size);
-			if (!resp) {
-				warn("Failed to allocate response packet\n");
-				return -errno;
-			}
-			resp->header = req->header;
-			resp->range = req->range;
-			resp->status = DIAG_CMD_MSG_STATUS_SUCCESSFUL;
-			resp->rsvd = req->rsvd;
-			memcpy(resp->rt_masks, req->masks, masks_size);
-
-			peripheral_broadcast_msg_mask(&resp->range);
+		ret = diag_cmd_set_msg_mask(req->range, req->masks);
+		if (ret) {
+			masks_size = 0;
 		} else {
-			resp = malloc(resp_size);
-			if (!resp) {
-				warn("Failed to allocate response packet\n");
-				return -errno;
-			}
-			resp->header = req->header;
-			resp->range = req->range;
-			resp->rsvd = req->rsvd;
-			resp->status = DIAG_CMD_MSG_STATUS_UNSUCCESSFUL;
+			range = req->range;
+			peripheral_broadcast_msg_mask(&range);
 		}
 
-		dm_send(client, resp, resp_size);
-		free(resp);
+		mbuf = dm_response_alloc(sizeof(*resp) + masks_size);
+		if (!mbuf)
+			return -ENOMEM;
+		resp = (void *)mbuf->data;
+		resp->header = req->header;
+		resp->range = req->range;
+		resp->rsvd = req->rsvd;
+		resp->status = ret ? DIAG_CMD_MSG_STATUS_UNSUCCESSFUL :
+				     DIAG_CMD_MSG_STATUS_SUCCESSFUL;
+		memcpy(resp->rt_masks, req->masks, masks_size);
+
+		dm_send_mbuf(client, mbuf);
 
 		break;
 	}
@@ -444,44 +420,32 @@ static int handle_event_get_mask(struct diag_client *client, const void *buf,
 		uint16_t num_bits;
 		uint8_t mask[0];
 	} __packed *resp;
-	uint32_t resp_size = sizeof(*resp);
 	uint16_t num_bits = event_max_num_bits;
 	uint16_t mask_size = 0;
-	uint8_t *mask = NULL;
+	const uint8_t *mask;
+	struct mbuf *mbuf;
+	int ret;
 
 	if (sizeof(*req) != len)
 		return -EMSGSIZE;
 
-	if (diag_cmd_get_event_mask(num_bits, &mask) == 0) {
+	ret = diag_cmd_get_event_mask(num_bits, &mask);
+	if (!ret)
 		mask_size = BITS_TO_BYTES(num_bits);
-		resp_size += mask_size;
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
-		resp->cmd_code = req->cmd_code;
-		resp->reserved = req->reserved;
-		resp->num_bits = num_bits;
-		if (mask != NULL) {
-			memcpy(&resp->mask, mask, mask_size);
-			free(mask);
-		}
-		resp->error_code = DIAG_CMD_EVENT_ERROR_CODE_OK;
-	} else {
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
-		resp->cmd_code = req->cmd_code;
-		resp->reserved = req->reserved;
-		resp->num_bits = 0;
-		resp->error_code = DIAG_CMD_EVENT_ERROR_CODE_FAIL;
-	}
 
-	dm_send(client, resp, resp_size);
-	free(resp);
+	mbuf = dm_response_alloc(sizeof(*resp) + mask_size);
+	if (!mbuf)
+		return -ENOMEM;
+	resp = (void *)mbuf->data;
+	resp->cmd_code = req->cmd_code;
+	resp->reserved = req->reserved;
+	resp->num_bits = ret ? 0 : num_bits;
+	resp->error_code = ret ? DIAG_CMD_EVENT_ERROR_CODE_FAIL :
+				 DIAG_CMD_EVENT_ERROR_CODE_OK;
+	if (!ret)
+		memcpy(resp->mask, mask, mask_size);
+
+	dm_send_mbuf(client, mbuf);
 
 	return 0;
 }
@@ -503,40 +467,31 @@ static int handle_event_set_mask(struct diag_client *client,
 		uint16_t num_bits;
 		uint8_t mask[0];
 	} __packed *resp;
-	uint32_t resp_size = sizeof(*resp);
 	uint16_t mask_size = BITS_TO_BYTES(req->num_bits);
+	struct mbuf *mbuf;
+	int ret;
 
 	if (sizeof(*req) + mask_size != len)
 		return -EMSGSIZE;
 
-	if (diag_cmd_update_event_mask(req->num_bits, req->mask) == 0) {
-		resp_size += mask_size;
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
-		resp->cmd_code = req->cmd_code;
-		resp->reserved = req->reserved;
-		resp->num_bits = req->num_bits;
-		memcpy(resp->mask, req->mask, mask_size);
-		resp->error_code = DIAG_CMD_EVENT_ERROR_CODE_OK;
-
+	ret = diag_cmd_update_event_mask(req->num_bits, req->mask);
+	if (ret)
+		mask_size = 0;
+	else
 		peripheral_broadcast_event_mask();
-	} else {
-		resp = malloc(resp_size);
-		if (!resp) {
-			warn("Failed to allocate response packet\n");
-			return -errno;
-		}
-		resp->cmd_code = req->cmd_code;
-		resp->reserved = req->reserved;
-		resp->num_bits = 0;
-		resp->error_code = DIAG_CMD_EVENT_ERROR_CODE_FAIL;
-	}
 
-	dm_send(client, resp, resp_size);
-	free(resp);
+	mbuf = dm_response_alloc(sizeof(*resp) + mask_size);
+	if (!mbuf)
+		return -ENOMEM;
+	resp = (void *)mbuf->data;
+	resp->cmd_code = req->cmd_code;
+	resp->reserved = req->reserved;
+	resp->num_bits = ret ? 0 : req->num_bits;
+	resp->error_code = ret ? DIAG_CMD_EVENT_ERROR_CODE_FAIL :
+				 DIAG_CMD_EVENT_ERROR_CODE_OK;
+	memcpy(resp->mask, req->mask, mask_size);
+
+	dm_send_mbuf(client, mbuf);
 
 	return 0;
 }
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_neon.h>
+#endif
+
+#include "crc16.h"
+#include "util.h"
+
+/*
+ * Reversed CRC-CCITT-16, with polynomial x^16 + x^12 + x^5 + 1 (0x8408), as
+ * used for the HDLC frame check sequence.
+ *
+ * The byte-wise reference is a table lookup as described in
+ * http://www.ross.net/crc/download/crc_v3.txt, the slice-by-8 and slice-by-16
+ * variants consume 8 or 16 bytes per step from as many derived tables and
+ * the PCLMULQDQ and PMULL variants fold 64 bytes at a time using carry-less
+ * multiplication, leaving the final 16 bytes to the tables.
+ */
+static const uint16_t crc16_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf, 0x8c48,
+	0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7, 0x1081, 0x0108,
+	0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e, 0x9cc9, 0x8d40, 0xbfdb,
+	0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876, 0x2102, 0x308b, 0x0210, 0x1399,
+	0x6726, 0x76af, 0x4434, 0x55bd, 0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e,
+	0xfae7, 0xc87c, 0xd9f5, 0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e,
+	0x54b5, 0x453c, 0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd,
+	0xc974, 0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3, 0x5285,
+	0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a, 0xdecd, 0xcf44,
+	0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72, 0x6306, 0x728f, 0x4014,
+	0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9, 0xef4e, 0xfec7, 0xcc5c, 0xddd5,
+	0xa96a, 0xb8e3, 0x8a78, 0x9bf1, 0x7387, 0x620e, 0x5095, 0x411c, 0x35a3,
+	0x242a, 0x16b1, 0x0738, 0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862,
+	0x9af9, 0x8b70, 0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e,
+	0xf0b7, 0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036, 0x18c1,
+	0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e, 0xa50a, 0xb483,
+	0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5, 0x2942, 0x38cb, 0x0a50,
+	0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd, 0xb58b, 0xa402, 0x9699, 0x8710,
+	0xf3af, 0xe226, 0xd0bd, 0xc134, 0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7,
+	0x6e6e, 0x5cf5, 0x4d7c, 0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1,
+	0xa33a, 0xb2b3, 0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72,
+	0x3efb, 0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a, 0xe70e,
+	0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1, 0x6b46, 0x7acf,
+	0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9, 0xf78f, 0xe606, 0xd49d,
+	0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330, 0x7bc7, 0x6a4e, 0x58d5, 0x495c,
+	0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+static uint16_t crc16_slice_table[16][256];
+
+/* Fold constants, bit-reflected x^(n - 1) mod P for distances of n bits */
+static uint64_t crc16_k128[2];
+static uint64_t crc16_k512[2];
+
+static bool crc16_initialized;
+
+static uint16_t crc16_bytewise(uint16_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		crc = (crc >> 8) ^ crc16_table[(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+static uint16_t crc16_slice8(uint16_t crc, const void *buf, size_t len)
+{
+	uint16_t (*t)[256] = crc16_slice_table;
+	const uint8_t *p = buf;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		crc = t[7][(p[0] ^ crc) & 0xff] ^ t[6][p[1] ^ (crc >> 8)] ^
+		      t[5][p[2]] ^ t[4][p[3]] ^ t[3][p[4]] ^ t[2][p[5]] ^
+		      t[1][p[6]] ^ t[0][p[7]];
+	}
+
+	return crc16_bytewise(crc, p, len);
+}
+
+static uint16_t crc16_slice16(uint16_t crc, const void *buf, size_t len)
+{
+	uint16_t (*t)[256] = crc16_slice_table;
+	const uint8_t *p = buf;
+
+	for (; len >= 16; len -= 16, p += 16) {
+		crc = t[15][(p[0] ^ crc) & 0xff] ^ t[14][p[1] ^ (crc >> 8)] ^
+		      t[13][p[2]] ^ t[12][p[3]] ^ t[11][p[4]] ^ t[10][p[5]] ^
+		      t[9][p[6]] ^ t[8][p[7]] ^ t[7][p[8]] ^ t[6][p[9]] ^
+		      t[5][p[10]] ^ t[4][p[11]] ^ t[3][p[12]] ^ t[2][p[13]] ^
+		      t[1][p[14]] ^ t[0][p[15]];
+	}
+
+	return crc16_slice8(crc, p, len);
+}
+
+static bool crc16_always(void)
+{
+	return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("pclmul,sse2")))
+static inline __m128i crc16_fold_pclmul(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			     _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc16_pclmul(uint16_t crc, const void *buf, size_t len)
+{
+	const __m128i k128 = _mm_loadu_si128((const __m128i *)crc16_k128);
+	const __m128i k512 = _mm_loadu_si128((const __m128i *)crc16_k512);
+	const uint8_t *p = buf;
+	uint8_t tail[16];
+	__m128i x0, x1, x2, x3;
+
+	if (len < 64)
+		return crc16_slice16(crc, buf, len);
+
+	x0 = _mm_loadu_si128((const __m128i *)p);
+	x1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 32));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 48));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		x0 = _mm_xor_si128(crc16_fold_pclmul(x0, k512),
+				   _mm_loadu_si128((const __m128i *)p));
+		x1 = _mm_xor_si128(crc16_fold_pclmul(x1, k512),
+				   _mm_loadu_si128((const __m128i *)(p + 16)));
+		x2 = _mm_xor_si128(crc16_fold_pclmul(x2, k512),
+				   _mm_loadu_si128((const __m128i *)(p + 32)));
+		x3 = _mm_xor_si128(crc16_fold_pclmul(x3, k512),
+				   _mm_loadu_si128((const __m128i *)(p + 48)));
+	}
+
+	x0 = _mm_xor_si128(crc16_fold_pclmul(x0, k128), x1);
+	x0 = _mm_xor_si128(crc16_fold_pclmul(x0, k128), x2);
+	x0 = _mm_xor_si128(crc16_fold_pclmul(x0, k128), x3);
+
+	for (; len >= 16; len -= 16, p += 16) {
+		x0 = _mm_xor_si128(crc16_fold_pclmul(x0, k128),
+				   _mm_loadu_si128((const __m128i *)p));
+	}
+
+	_mm_storeu_si128((__m128i *)tail, x0);
+	crc = crc16_slice16(0, tail, sizeof(tail));
+
+	return crc16_slice16(crc, p, len);
+}
+
+static bool crc16_has_pclmul(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse2");
+}
+#endif
+
+#if defined(__aarch64__)
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc16_fold_pmull(uint64x2_t x, poly64x2_t k)
+{
+	poly128_t lo;
+	poly128_t hi;
+
+	lo = vmull_p64((poly64_t)vgetq_lane_u64(x, 0), vgetq_lane_p64(k, 0));
+	hi = vmull_high_p64(vreinterpretq_p64_u64(x), k);
+
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+__attribute__((target("+crypto")))
+static uint16_t crc16_pmull(uint16_t crc, const void *buf, size_t len)
+{
+	const poly64x2_t k128 = vreinterpretq_p64_u64(vld1q_u64(crc16_k128));
+	const poly64x2_t k512 = vreinterpretq_p64_u64(vld1q_u64(crc16_k512));
+	const uint8_t *p = buf;
+	uint8_t tail[16];
+	uint64x2_t x0, x1, x2, x3;
+
+	if (len < 64)
+		return crc16_slice16(crc, buf, len);
+
+	x0 = vreinterpretq_u64_u8(vld1q_u8(p));
+	x1 = vreinterpretq_u64_u8(vld1q_u8(p + 16));
+	x2 = vreinterpretq_u64_u8(vld1q_u8(p + 32));
+	x3 = vreinterpretq_u64_u8(vld1q_u8(p + 48));
+	x0 = veorq_u64(x0, vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		x0 = veorq_u64(crc16_fold_pmull(x0, k512),
+			       vreinterpretq_u64_u8(vld1q_u8(p)));
+		x1 = veorq_u64(crc16_fold_pmull(x1, k512),
+			       vreinterpretq_u64_u8(vld1q_u8(p + 16)));
+		x2 = veorq_u64(crc16_fold_pmull(x2, k512),
+			       vreinterpretq_u64_u8(vld1q_u8(p + 32)));
+		x3 = veorq_u64(crc16_fold_pmull(x3, k512),
+			       vreinterpretq_u64_u8(vld1q_u8(p + 48)));
+	}
+
+	x0 = veorq_u64(crc16_fold_pmull(x0, k128), x1);
+	x0 = veorq_u64(crc16_fold_pmull(x0, k128), x2);
+	x0 = veorq_u64(crc16_fold_pmull(x0, k128), x3);
+
+	for (; len >= 16; len -= 16, p += 16) {
+		x0 = veorq_u64(crc16_fold_pmull(x0, k128),
+			       vreinterpretq_u64_u8(vld1q_u8(p)));
+	}
+
+	vst1q_u8(tail, vreinterpretq_u8_u64(x0));
+	crc = crc16_slice16(0, tail, sizeof(tail));
+
+	return crc16_slice16(crc, p, len);
+}
+
+static bool crc16_has_pmull(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#endif
+
+/* Ordered from the slowest to the fastest variant */
+static const struct crc16_impl crc16_impls[] = {
+	{ "bytewise", crc16_bytewise, crc16_always },
+	{ "slice-by-8", crc16_slice8, crc16_always },
+	{ "slice-by-16", crc16_slice16, crc16_always },
+#if defined(__x86_64__) || defined(__i386__)
+	{ "pclmulqdq", crc16_pclmul, crc16_has_pclmul },
+#endif
+#if defined(__aarch64__)
+	{ "pmull", crc16_pmull, crc16_has_pmull },
+#endif
+};
+
+static const struct crc16_impl *crc16_active;
+
+/*
+ * Bit-reflected representation of x^(n - 1) mod P, as a 64-bit operand. The
+ * product of two reflected 64-bit operands ends up one bit short of its
+ * place in the reflected 128-bit result, which the lower power accounts for.
+ */
+static uint64_t crc16_fold_constant(unsigned int n)
+{
+	uint32_t r = 1;
+	uint64_t k = 0;
+	int i;
+
+	while (--n) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x11021;
+	}
+
+	for (i = 0; i < 16; i++) {
+		if (r & (1 << i))
+			k |= 1ULL << (63 - i);
+	}
+
+	return k;
+}
+
+static void crc16_init(void)
+{
+	unsigned int i;
+	unsigned int j;
+	uint16_t crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc16_table[i];
+		crc16_slice_table[0][i] = crc;
+
+		for (j = 1; j < 16; j++) {
+			crc = (crc >> 8) ^ crc16_table[crc & 0xff];
+			crc16_slice_table[j][i] = crc;
+		}
+	}
+
+	/* Folding distances of one and of four 128-bit blocks */
+	crc16_k128[0] = crc16_fold_constant(128 + 64);
+	crc16_k128[1] = crc16_fold_constant(128);
+	crc16_k512[0] = crc16_fold_constant(512 + 64);
+	crc16_k512[1] = crc16_fold_constant(512);
+
+	crc16_initialized = true;
+}
+
+/**
+ * crc16_selftest() - verify a CRC implementation against the reference table
+ * @impl:	implementation to test, must be supported by the CPU
+ *
+ * Return: 0 on success, -1 if any result differs
+ */
+int crc16_selftest(const struct crc16_impl *impl)
+{
+	uint8_t buf[1024 + 16];
+	uint16_t expected;
+	uint16_t crc;
+	size_t align;
+	size_t len;
+	size_t i;
+
+	if (!crc16_initialized)
+		crc16_init();
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 251 + (i >> 3);
+
+	for (align = 0; align < 16; align += 5) {
+		for (len = 0; len <= 1024; len += len < 160 ? 1 : 37) {
+			expected = crc16_bytewise(0xffff, buf + align, len);
+			crc = impl->update(0xffff, buf + align, len);
+			if (crc != expected)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * crc16_impl_get() - enumerate the CRC implementations
+ * @idx:	index of the implementation
+ *
+ * Return: the implementation, or NULL if @idx is out of range
+ */
+const struct crc16_impl *crc16_impl_get(unsigned int idx)
+{
+	if (!crc16_initialized)
+		crc16_init();
+
+	if (idx >= ARRAY_SIZE(crc16_impls))
+		return NULL;
+
+	return &crc16_impls[idx];
+}
+
+/* Pick the fastest variant supported by the CPU and passing the self-test */
+static void crc16_select(void)
+{
+	const struct crc16_impl *impl;
+	int i;
+
+	if (!crc16_initialized)
+		crc16_init();
+
+	for (i = ARRAY_SIZE(crc16_impls) - 1; i >= 0; i--) {
+		impl = &crc16_impls[i];
+		if (!impl->supported())
+			continue;
+
+		if (crc16_selftest(impl) < 0) {
+			fprintf(stderr, "crc16: %s implementation failed self-test\n",
+				impl->name);
+			continue;
+		}
+
+		crc16_active = impl;
+		return;
+	}
+}
+
+/**
+ * crc16() - update a reversed CRC-CCITT-16
+ * @crc:	CRC of the preceding data, or the initial value
+ * @buf:	data to add to the CRC
+ * @len:	length of @buf
+ *
+ * Return: the updated CRC, without any final XOR applied
+ */
+uint16_t crc16(uint16_t crc, const void *buf, size_t len)
+{
+	if (!crc16_active)
+		crc16_select();
+
+	return crc16_active->update(crc, buf, len);
+}
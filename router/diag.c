@@ -29,8 +29,13 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/signalfd.h>
+
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,14 +43,27 @@
 #include <string.h>
 
 #include "diag.h"
+#include "diag_cntl.h"
+#include "dm.h"
 #include "hdlc.h"
 #include "masks.h"
 #include "mbuf.h"
 #include "peripheral.h"
+#include "presets.h"
 #include "util.h"
 #include "watch.h"
 
-struct list_head diag_cmds = LIST_INIT(diag_cmds);
+struct cmd_table diag_cmds;
+
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow)
+{
+	mbuf->flow = flow;
+
+	watch_flow_inc(flow, mbuf->size);
+
+	list_add(queue, &mbuf->node);
+}
 
 void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
 		     struct watch_flow *flow)
@@ -54,14 +72,13 @@ void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
 	void *ptr;
 
 	mbuf = mbuf_alloc(msglen);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
 	ptr = mbuf_put(mbuf, msglen);
 	memcpy(ptr, msg, msglen);
 
-	mbuf->flow = flow;
-
-	watch_flow_inc(flow);
-
-	list_add(queue, &mbuf->node);
+	queue_push_mbuf(queue, mbuf, flow);
 }
 
 void queue_push(struct list_head *queue, const void *msg, size_t msglen)
@@ -69,15 +86,134 @@ void queue_push(struct list_head *queue, const void *msg, size_t msglen)
 	queue_push_flow(queue, msg, msglen, NULL);
 }
 
+static int stats_signal(int fd, __attribute__((unused)) void *data)
+{
+	struct signalfd_siginfo info;
+	ssize_t n;
+
+	n = read(fd, &info, sizeof(info));
+	if (n != sizeof(info))
+		return 0;
+
+	mbuf_pool_stats(stderr);
+	hdlc_stats(stderr);
+	dm_stats(stderr);
+	peripheral_stats(stderr);
+
+	return 0;
+}
+
+/* Dump buffer pool, HDLC, DM and flow control statistics upon SIGUSR1 */
+static void stats_init(void)
+{
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		warn("failed to block SIGUSR1");
+		return;
+	}
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) {
+		warn("failed to create signalfd");
+		return;
+	}
+
+	watch_add_readfd(fd, stats_signal, NULL, NULL);
+}
+
+/* Parse a number, rejecting anything but plain decimal digits */
+static int parse_ulong(const char *token, unsigned long *val)
+{
+	char *end;
+
+	if (!isdigit((unsigned char)*token))
+		return -EINVAL;
+
+	errno = 0;
+	*val = strtoul(token, &end, 10);
+	if (errno || *end)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int parse_uint(const char *token, unsigned int *val)
+{
+	unsigned long n;
+
+	if (parse_ulong(token, &n) < 0 || n > UINT_MAX)
+		return -EINVAL;
+
+	*val = n;
+
+	return 0;
+}
+
+static int parse_bytes(const char *token, size_t *bytes)
+{
+	unsigned long n;
+
+	if (parse_ulong(token, &n) < 0 || n > SIZE_MAX)
+		return -EINVAL;
+
+	*bytes = n;
+
+	return 0;
+}
+
+/* Parse peripheral:high[:low], the low watermark defaulting to high / 4 */
+static int parse_flow_limits(const char *arg)
+{
+	char *copy;
+	char *name;
+	char *token;
+	size_t high;
+	size_t low;
+	int ret = -EINVAL;
+
+	copy = strdup(arg);
+	if (!copy)
+		err(1, "failed to parse flow control limits");
+
+	name = strtok(copy, ":");
+	token = strtok(NULL, ":");
+	if (!name || !token || parse_bytes(token, &high) < 0)
+		goto out;
+
+	token = strtok(NULL, "");
+	if (!token)
+		low = high / 4;
+	else if (parse_bytes(token, &low) < 0)
+		goto out;
+
+	ret = peripheral_set_flow_limits(name, high, low);
+
+out:
+	free(copy);
+
+	return ret;
+}
+
 static void usage(void)
 {
 	fprintf(stderr,
 		"User space application for diag interface\n"
 		"\n"
-		"usage: diag [-hsu]\n"
+		"usage: diag [-befhmpPsu]\n"
 		"\n"
 		"options:\n"
+		"   -b   <USB bulk-in transfer size, 0 to disable aggregation>\n"
+		"   -e   <I/O engine: aio or uring>\n"
+		"   -f   <peripheral:high[:low] flow control watermarks, in bytes>\n"
 		"   -h   show this usage\n"
+		"   -m   <window for coalescing mask updates, in ms, 0 to disable>\n"
+		"   -p   <number of buffers to preallocate per size class>\n"
+		"   -P   <mask presets file>\n"
 		"   -s   <socket address[:port]>\n"
 		"   -u   <uart device name[@baudrate]>\n"
 	);
@@ -91,15 +227,52 @@ int main(int argc, char **argv)
 	int host_port = DEFAULT_SOCKET_PORT;
 	char *uartdev = NULL;
 	int baudrate = DEFAULT_BAUD_RATE;
+	unsigned int prealloc = 0;
+	unsigned int commit_delay;
+	size_t usb_xfer_size = DEFAULT_USB_XFER_SIZE;
 	char *token;
 	int ret;
 	int c;
 
 	for (;;) {
-		c = getopt(argc, argv, "hs:u:");
+		c = getopt(argc, argv, "b:e:f:hm:p:P:s:u:");
 		if (c < 0)
 			break;
 		switch (c) {
+		case 'b':
+			ret = parse_bytes(optarg, &usb_xfer_size);
+			if (ret < 0)
+				errx(1, "invalid bulk-in transfer size \"%s\"",
+				     optarg);
+			break;
+		case 'e':
+			ret = watch_set_io_engine(optarg);
+			if (ret < 0)
+				errx(1, "unsupported I/O engine \"%s\"", optarg);
+			break;
+		case 'f':
+			ret = parse_flow_limits(optarg);
+			if (ret < 0)
+				errx(1, "invalid flow control limits \"%s\"",
+				     optarg);
+			break;
+		case 'm':
+			ret = parse_uint(optarg, &commit_delay);
+			if (ret < 0)
+				errx(1, "invalid mask commit delay \"%s\"", optarg);
+			diag_cntl_set_commit_delay(commit_delay);
+			break;
+		case 'p':
+			ret = parse_uint(optarg, &prealloc);
+			if (ret < 0)
+				errx(1, "invalid number of buffers \"%s\"", optarg);
+			break;
+		case 'P':
+			ret = diag_presets_load(optarg);
+			if (ret < 0)
+				errx(1, "failed to load mask presets \"%s\": %s",
+				     optarg, strerror(-ret));
+			break;
 		case 's':
 			host_address = strtok(strdup(optarg), ":");
 			token = strtok(NULL, "");
@@ -119,6 +292,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	ret = mbuf_pool_prealloc(prealloc);
+	if (ret < 0)
+		errx(1, "failed to preallocate buffers");
+
+	stats_init();
+
 	if (host_address) {
 		ret = diag_sock_connect(host_address, host_port);
 		if (ret < 0)
@@ -129,7 +308,7 @@ int main(int argc, char **argv)
 			errx(1, "failed to open uart\n");
 	}
 
-	diag_usb_open("/dev/ffs-diag");
+	diag_usb_open("/dev/ffs-diag", usb_xfer_size);
 
 	ret = diag_unix_open();
 	if (ret < 0)
@@ -144,5 +323,10 @@ int main(int argc, char **argv)
 
 	watch_run();
 
+	mbuf_pool_stats(stderr);
+	hdlc_stats(stderr);
+	dm_stats(stderr);
+	peripheral_stats(stderr);
+
 	return 0;
 }
@@ -36,12 +36,14 @@
 #include <sys/types.h>
 
 #include "circ_buf.h"
+#include "cmd_table.h"
 #include "hdlc.h"
 #include "list.h"
 #include "watch.h"
 
 #define DEFAULT_SOCKET_PORT 2500
 #define DEFAULT_BAUD_RATE 115200
+#define DEFAULT_USB_XFER_SIZE (16 * 1024)
 
 #define BIT(x) (1 << (x))
 
@@ -65,6 +67,7 @@
 #define DIAG_CMD_SUBSYS_DISPATCH_V2	128
 
 struct diag_client;
+struct diag_cntl_sent_masks;
 
 struct peripheral {
 	struct list_head  node;
@@ -86,6 +89,10 @@ struct peripheral {
 
 	struct watch_flow *flow;
 
+	struct diag_cntl_sent_masks *sent_masks;
+	unsigned int num_presets;
+	bool presets_sent;
+
 	int diag_id;
 
 	bool sockets;
@@ -100,8 +107,6 @@ struct peripheral {
 extern struct list_head peripherals;
 
 struct diag_cmd {
-	struct list_head node;
-
 	unsigned int first;
 	unsigned int last;
 
@@ -112,16 +117,21 @@ struct diag_cmd {
 void queue_push(struct list_head *queue, const void *msg, size_t msglen);
 void queue_push_flow(struct list_head *queue, const void *msg, size_t msglen,
 		     struct watch_flow *flow);
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow);
 
-extern struct list_head diag_cmds;
+extern struct cmd_table diag_cmds;
 
 int diag_sock_connect(const char *hostname, unsigned short port);
 int diag_uart_open(const char *uartname, unsigned int baudrate);
-int diag_usb_open(const char *ffs_name);
+int diag_usb_open(const char *ffs_name, size_t xfer_size);
 int diag_unix_open(void);
 
 int diag_client_handle_command(struct diag_client *client, uint8_t *data, size_t len);
+void diag_cmd_response(struct peripheral *peripheral, struct mbuf *mbuf);
+void diag_cmd_forget(struct peripheral *peripheral);
 
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen);
 int hdlc_enqueue(struct list_head *queue, const void *buf, size_t msglen);
 int hdlc_enqueue_flow(struct list_head *queue, const void *buf, size_t msglen,
 		 struct watch_flow *flow);
@@ -41,6 +41,7 @@
 #include "diag_cntl.h"
 #include "masks.h"
 #include "peripheral.h"
+#include "presets.h"
 #include "util.h"
 
 #define DIAG_CTRL_MSG_DTR               2
@@ -165,7 +166,49 @@ struct diag_cntl_cmd_event_mask {
 struct diag_cntl_num_presets {
 	struct diag_cntl_hdr hdr;
 	uint8_t num;
-};
+} __packed;
+#define to_num_presets(h) container_of(h, struct diag_cntl_num_presets, hdr)
+
+#define DIAG_CNTL_CMD_SET_PRESET_ID 13
+struct diag_cntl_cmd_set_preset_id {
+	struct diag_cntl_hdr hdr;
+	uint8_t preset_id;
+} __packed;
+
+#define DIAG_CNTL_CMD_LOG_MASK_WITH_PRESET_ID 14
+struct diag_cntl_cmd_preset_log_mask {
+	struct diag_cntl_hdr hdr;
+	uint8_t stream_id;
+	uint8_t preset_id;
+	uint8_t status;
+	uint8_t equip_id;
+	uint32_t last_item;
+	uint32_t log_mask_size;
+	uint8_t equip_log_mask[];
+} __packed;
+
+#define DIAG_CNTL_CMD_EVENT_MASK_WITH_PRESET_ID 15
+struct diag_cntl_cmd_preset_event_mask {
+	struct diag_cntl_hdr hdr;
+	uint8_t stream_id;
+	uint8_t preset_id;
+	uint8_t status;
+	uint8_t event_config;
+	uint32_t event_mask_len;
+	uint8_t event_mask[];
+} __packed;
+
+#define DIAG_CNTL_CMD_MSG_MASK_WITH_PRESET_ID 16
+struct diag_cntl_cmd_preset_msg_mask {
+	struct diag_cntl_hdr hdr;
+	uint8_t stream_id;
+	uint8_t preset_id;
+	uint8_t status;
+	uint8_t msg_mode;
+	struct diag_ssid_range_t range;
+	uint32_t msg_mask_len;
+	uint8_t range_msg_mask[];
+} __packed;
 
 struct cmd_range_dereg {
 	uint16_t first;
@@ -227,12 +270,12 @@ struct diag_cntl_cmd_diag_id_v2 {
 struct list_head diag_ids = LIST_INIT(diag_ids);
 
 static void diag_cntl_send_feature_mask(struct peripheral *peripheral, uint32_t mask);
+static void diag_cntl_send_presets(struct peripheral *peripheral);
 
 static int diag_cntl_register(struct peripheral *peripheral,
 			      struct diag_cntl_hdr *hdr, size_t len)
 {
 	struct diag_cntl_cmd_reg *pkt = to_cmd_reg(hdr);
-	struct diag_cmd *dc;
 	unsigned int subsys;
 	unsigned int cmd;
 	unsigned int first;
@@ -252,18 +295,7 @@ static int diag_cntl_register(struct peripheral *peripheral,
 		// printf("[%s] register 0x%x - 0x%x\n",
 		//	  peripheral->name, first, last);
 
-		dc = malloc(sizeof(*dc));
-		if (!dc) {
-			warn("malloc failed");
-			return -ENOMEM;
-		}
-		memset(dc, 0, sizeof(*dc));
-
-		dc->first = first;
-		dc->last = last;
-		dc->peripheral = peripheral;
-
-		list_add(&diag_cmds, &dc->node);
+		cmd_table_add(&diag_cmds, first, last, peripheral, NULL);
 	}
 
 	return 0;
@@ -285,6 +317,8 @@ static int diag_cntl_feature_mask(struct peripheral *peripheral,
 		local_mask |= DIAG_FEATURE_SOCKETS_ENABLED;
 	local_mask |= DIAG_FEATURE_DIAG_ID;
 	local_mask |= DIAG_FEATURE_DIAG_ID_FEATURE_MASK;
+	if (diag_presets_count())
+		local_mask |= DIAG_FEATURE_DIAG_PRESET_MASKS;
 
 	printf("[%s] mask:", peripheral->name);
 
@@ -294,6 +328,8 @@ static int diag_cntl_feature_mask(struct peripheral *peripheral,
 		printf(" DIAG_MASTER_SETS_COMMON_MASK");
 	if (mask & DIAG_FEATURE_LOG_ON_DEMAND_APPS)
 		printf(" LOG_ON_DEMAND");
+	if (mask & DIAG_FEATURE_DIAG_PRESET_MASKS)
+		printf(" PRESET-MASKS");
 	if (mask & DIAG_FEATURE_DIAG_VERSION_RSP_ON_MASTER)
 		printf(" DIAG_VERSION_RSP_ON_MASTER");
 	if (mask & DIAG_FEATURE_REQ_RSP_SUPPORT)
@@ -320,27 +356,194 @@ static int diag_cntl_feature_mask(struct peripheral *peripheral,
 
 	diag_cntl_send_feature_mask(peripheral, peripheral->features);
 
+	peripheral->presets_sent = false;
+	diag_cntl_send_presets(peripheral);
+
 	return 0;
 }
 
-void diag_cntl_send_log_mask(struct peripheral *peripheral, uint32_t equip_id)
+static int diag_cntl_num_presets(struct peripheral *peripheral,
+				 struct diag_cntl_hdr *hdr, size_t len)
+{
+	struct diag_cntl_num_presets *pkt = to_num_presets(hdr);
+
+	if (hdr->len < sizeof(*pkt) - sizeof(*hdr))
+		return -EINVAL;
+
+	peripheral->num_presets = pkt->num;
+	peripheral->presets_sent = false;
+
+	diag_cntl_send_presets(peripheral);
+
+	return 0;
+}
+
+/* Largest buffer of batched mask updates sent to a peripheral */
+#define DIAG_CNTL_BATCH_MAX		(8 * 1024)
+/* Number of times a commit is postponed, while the tools keep busy */
+#define DIAG_CNTL_COMMIT_MAX_DEFERRALS	4
+
+/**
+ * struct diag_cntl_sent - mask update last sent to a peripheral
+ * @pkt:	copy of the control packet, NULL if not known
+ * @len:	length of @pkt
+ */
+struct diag_cntl_sent {
+	void *pkt;
+	size_t len;
+};
+
+/**
+ * struct diag_cntl_sent_masks - mask state last sent to a peripheral
+ * @msg:	update of each SSID range
+ * @msg_all:	update applying to all SSID ranges
+ * @log:	update of each equip ID
+ * @log_all:	update applying to all equip IDs
+ * @event:	update of the event mask
+ * @msg_dirty:	SSID ranges with an update to commit, one bit per range
+ * @log_dirty:	equip IDs with an update to commit, one bit per equip ID
+ * @event_dirty: the event mask has an update to commit
+ *
+ * A peripheral is in the state described by @msg_all, or @log_all, only
+ * until it's sent an update of a single range, or equip ID; and the other
+ * way around.
+ */
+struct diag_cntl_sent_masks {
+	struct diag_cntl_sent msg[MSG_MASK_TBL_CNT];
+	struct diag_cntl_sent msg_all;
+	struct diag_cntl_sent log[MAX_EQUIP_ID];
+	struct diag_cntl_sent log_all;
+	struct diag_cntl_sent event;
+
+	uint32_t msg_dirty;
+	uint16_t log_dirty;
+	bool event_dirty;
+};
+
+/**
+ * struct diag_cntl_batch - control packets to be sent as one buffer
+ * @peripheral:	peripheral the packets are destined to
+ * @len:	amount of @buf filled in
+ * @buf:	packets, back to back
+ */
+struct diag_cntl_batch {
+	struct peripheral *peripheral;
+	size_t len;
+	char buf[DIAG_CNTL_BATCH_MAX];
+};
+
+static unsigned int mask_commit_delay = DIAG_CNTL_DEFAULT_COMMIT_DELAY;
+static struct watch_timer *mask_commit_timer;
+static unsigned int mask_commit_deferrals;
+static bool mask_commit_postponed;
+
+static struct diag_cntl_sent_masks *diag_cntl_sent_masks(struct peripheral *peripheral)
+{
+	if (!peripheral->sent_masks) {
+		peripheral->sent_masks = calloc(1, sizeof(*peripheral->sent_masks));
+		if (!peripheral->sent_masks)
+			err(1, "failed to allocate mask state");
+	}
+
+	return peripheral->sent_masks;
+}
+
+static void diag_cntl_sent_forget(struct diag_cntl_sent *sent, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		free(sent[i].pkt);
+		sent[i].pkt = NULL;
+		sent[i].len = 0;
+	}
+}
+
+/* Forget what the peripheral was sent, keeping the updates yet to commit */
+static void diag_cntl_sent_clear(struct peripheral *peripheral)
 {
+	struct diag_cntl_sent_masks *sent = peripheral->sent_masks;
+
+	if (!sent)
+		return;
+
+	diag_cntl_sent_forget(sent->msg, MSG_MASK_TBL_CNT);
+	diag_cntl_sent_forget(&sent->msg_all, 1);
+	diag_cntl_sent_forget(sent->log, MAX_EQUIP_ID);
+	diag_cntl_sent_forget(&sent->log_all, 1);
+	diag_cntl_sent_forget(&sent->event, 1);
+}
+
+static void diag_cntl_sent_reset(struct peripheral *peripheral)
+{
+	diag_cntl_sent_clear(peripheral);
+
+	free(peripheral->sent_masks);
+	peripheral->sent_masks = NULL;
+}
+
+/*
+ * Record @pkt as the last update sent for a mask, returning false if it
+ * matches the previous one, i.e. the peripheral already has the mask.
+ */
+static bool diag_cntl_sent_update(struct diag_cntl_sent *sent,
+				  const void *pkt, size_t len)
+{
+	void *copy;
+
+	if (sent->pkt && sent->len == len && !memcmp(sent->pkt, pkt, len))
+		return false;
+
+	copy = realloc(sent->pkt, len);
+	if (!copy)
+		err(1, "failed to record mask update");
+
+	memcpy(copy, pkt, len);
+	sent->pkt = copy;
+	sent->len = len;
+
+	return true;
+}
+
+static void diag_cntl_batch_flush(struct diag_cntl_batch *batch)
+{
+	if (!batch->len)
+		return;
+
+	queue_push(&batch->peripheral->cntlq, batch->buf, batch->len);
+	batch->len = 0;
+}
+
+static void diag_cntl_batch_add(struct diag_cntl_batch *batch,
+				const void *pkt, size_t len)
+{
+	if (batch->len + len > sizeof(batch->buf))
+		diag_cntl_batch_flush(batch);
+
+	if (len > sizeof(batch->buf)) {
+		queue_push(&batch->peripheral->cntlq, pkt, len);
+		return;
+	}
+
+	memcpy(batch->buf + batch->len, pkt, len);
+	batch->len += len;
+}
+
+static void diag_cntl_commit_log_mask(struct diag_cntl_batch *batch,
+				      uint32_t equip_id)
+{
+	struct peripheral *peripheral = batch->peripheral;
+	struct diag_cntl_sent_masks *sent = peripheral->sent_masks;
 	struct diag_cntl_cmd_log_mask *pkt;
 	size_t len = sizeof(*pkt);
 	uint32_t num_items = 0;
-	uint8_t *mask = NULL;
+	const uint8_t *mask = NULL;
 	uint32_t mask_size = 0;
 	uint8_t status = diag_get_log_mask_status();
 
-	if (peripheral == NULL)
-		return;
-	if (peripheral->cntl_fd == -1) {
-		warn("Peripheral %s has no control channel. Skipping!\n", peripheral->name);
-		return;
-	}
-
 	if (status == DIAG_CTRL_MASK_VALID) {
-		diag_cmd_get_log_mask(equip_id, &num_items, &mask, &mask_size);
+		if (diag_cmd_get_log_mask(equip_id, &num_items, &mask, &mask_size))
+			return;
 	} else {
 		equip_id = 0;
 	}
@@ -355,39 +558,51 @@ void diag_cntl_send_log_mask(struct peripheral *peripheral, uint32_t equip_id)
 	pkt->equip_id = equip_id;
 	pkt->last_item = num_items;
 	pkt->log_mask_size = mask_size;
-	if (mask != NULL) {
+	if (mask != NULL)
 		memcpy(pkt->equip_log_mask, mask, mask_size);
-		free(mask);
+
+	if (status == DIAG_CTRL_MASK_VALID) {
+		if (!diag_cntl_sent_update(&sent->log[equip_id], pkt, len))
+			return;
+
+		diag_cntl_sent_forget(&sent->log_all, 1);
+	} else {
+		if (!diag_cntl_sent_update(&sent->log_all, pkt, len))
+			return;
+
+		diag_cntl_sent_forget(sent->log, MAX_EQUIP_ID);
 	}
 
-	queue_push(&peripheral->cntlq, pkt, len);
+	diag_cntl_batch_add(batch, pkt, len);
 }
 
-void diag_cntl_send_msg_mask(struct peripheral *peripheral, struct diag_ssid_range_t *range)
+static void diag_cntl_commit_msg_mask(struct diag_cntl_batch *batch, int idx)
 {
+	struct peripheral *peripheral = batch->peripheral;
+	struct diag_cntl_sent_masks *sent = peripheral->sent_masks;
+	struct diag_ssid_range_t mask_range;
 	struct diag_cntl_cmd_msg_mask *pkt;
 	size_t len = sizeof(*pkt);
 	uint32_t num_items = 0;
-	uint32_t *mask = NULL;
+	const uint32_t *mask = NULL;
 	uint32_t mask_size = 0;
 	struct diag_ssid_range_t DUMMY_RANGE = { 0, 0 };
+	struct diag_ssid_range_t *range = &mask_range;
 	uint8_t status = diag_get_msg_mask_status();
 
-	if (peripheral == NULL)
-		return;
-	if (peripheral->cntl_fd == -1) {
-		warn("Peripheral %s has no control channel. Skipping!\n", peripheral->name);
-		return;
-	}
+	range->ssid_first = ssid_first_arr[idx];
+	range->ssid_last = ssid_last_arr[idx];
 
 	if (status == DIAG_CTRL_MASK_VALID) {
-		diag_cmd_get_msg_mask(range, &mask);
+		if (diag_cmd_get_msg_mask(range, &mask))
+			return;
 		num_items = range->ssid_last - range->ssid_first + 1;
 	} else if (status == DIAG_CTRL_MASK_ALL_DISABLED) {
 		range = &DUMMY_RANGE;
 		num_items = 0;
 	} else if (status == DIAG_CTRL_MASK_ALL_ENABLED) {
-		diag_cmd_get_msg_mask(range, &mask);
+		if (diag_cmd_get_msg_mask(range, &mask))
+			return;
 		num_items = 1;
 	}
 	mask_size = num_items * sizeof(*mask);
@@ -402,43 +617,35 @@ void diag_cntl_send_msg_mask(struct peripheral *peripheral, struct diag_ssid_ran
 	pkt->msg_mode = 0;
 	pkt->range = *range;
 	pkt->msg_mask_len = num_items;
-	if (mask != NULL) {
+	if (mask != NULL)
 		memcpy(pkt->range_msg_mask, mask, mask_size);
-		free(mask);
-	}
-
-	queue_push(&peripheral->cntlq, pkt, len);
-}
 
-void diag_cntl_send_masks(struct peripheral *peripheral)
-{
-	struct diag_ssid_range_t range;
-	int i;
+	if (status == DIAG_CTRL_MASK_ALL_DISABLED) {
+		if (!diag_cntl_sent_update(&sent->msg_all, pkt, len))
+			return;
 
-	for (i = 0; i < MSG_MASK_TBL_CNT; i++) {
-		range.ssid_first = ssid_first_arr[i];
-		range.ssid_last = ssid_last_arr[i];
+		diag_cntl_sent_forget(sent->msg, MSG_MASK_TBL_CNT);
+	} else {
+		if (!diag_cntl_sent_update(&sent->msg[idx], pkt, len))
+			return;
 
-		diag_cntl_send_msg_mask(peripheral, &range);
+		diag_cntl_sent_forget(&sent->msg_all, 1);
 	}
+
+	diag_cntl_batch_add(batch, pkt, len);
 }
 
-void diag_cntl_send_event_mask(struct peripheral *peripheral)
+static void diag_cntl_commit_event_mask(struct diag_cntl_batch *batch)
 {
+	struct peripheral *peripheral = batch->peripheral;
+	struct diag_cntl_sent_masks *sent = peripheral->sent_masks;
 	struct diag_cntl_cmd_event_mask *pkt;
 	size_t len = sizeof(*pkt);
-	uint8_t *mask = NULL;
+	const uint8_t *mask = NULL;
 	uint16_t mask_size = 0;
 	uint8_t status = diag_get_event_mask_status();
 	uint8_t event_config = (status == DIAG_CTRL_MASK_ALL_ENABLED || status == DIAG_CTRL_MASK_VALID) ? 0x1 : 0x0;
 
-	if (peripheral == NULL)
-		return;
-	if (peripheral->cntl_fd == -1) {
-		warn("Peripheral %s has no control channel. Skipping!\n", peripheral->name);
-		return;
-	}
-
 	if (status == DIAG_CTRL_MASK_VALID) {
 		if (diag_cmd_get_event_mask(event_max_num_bits , &mask) == 0) {
 			mask_size = BITS_TO_BYTES(event_max_num_bits);
@@ -454,26 +661,361 @@ void diag_cntl_send_event_mask(struct peripheral *peripheral)
 	pkt->status = status;
 	pkt->event_config = event_config;
 	pkt->event_mask_len = mask_size;
-	if (mask != NULL) {
+	if (mask != NULL)
 		memcpy(pkt->event_mask, mask, mask_size);
-		free(mask);
+
+	if (!diag_cntl_sent_update(&sent->event, pkt, len))
+		return;
+
+	diag_cntl_batch_add(batch, pkt, len);
+}
+
+/**
+ * diag_cntl_commit_masks() - send the pending mask updates of a peripheral
+ * @peripheral:	peripheral to update
+ *
+ * Each update is built from the current state of the masks, so a mask
+ * updated several times since the last commit is sent once; and all of
+ * them are sent in as few control buffers as possible.
+ */
+void diag_cntl_commit_masks(struct peripheral *peripheral)
+{
+	struct diag_cntl_sent_masks *sent = peripheral->sent_masks;
+	struct diag_cntl_batch *batch;
+	int i;
+
+	if (!sent)
+		return;
+
+	if (!sent->msg_dirty && !sent->log_dirty && !sent->event_dirty)
+		return;
+
+	batch = malloc(sizeof(*batch));
+	if (!batch)
+		err(1, "failed to allocate mask batch");
+
+	batch->peripheral = peripheral;
+	batch->len = 0;
+
+	for (i = 0; i < MSG_MASK_TBL_CNT; i++) {
+		if (sent->msg_dirty & BIT(i))
+			diag_cntl_commit_msg_mask(batch, i);
 	}
 
-	queue_push(&peripheral->cntlq, pkt, len);
+	for (i = 0; i < MAX_EQUIP_ID; i++) {
+		if (sent->log_dirty & BIT(i))
+			diag_cntl_commit_log_mask(batch, i);
+	}
+
+	if (sent->event_dirty)
+		diag_cntl_commit_event_mask(batch);
+
+	sent->msg_dirty = 0;
+	sent->log_dirty = 0;
+	sent->event_dirty = false;
+
+	diag_cntl_batch_flush(batch);
+	free(batch);
+}
+
+static void diag_cntl_commit_all(void *data)
+{
+	struct peripheral *peripheral;
+	struct list_head *item;
+
+	/* Let a burst of updates settle, within bounds */
+	if (mask_commit_postponed &&
+	    mask_commit_deferrals < DIAG_CNTL_COMMIT_MAX_DEFERRALS) {
+		mask_commit_postponed = false;
+		mask_commit_deferrals++;
+		mask_commit_timer = watch_add_timer(diag_cntl_commit_all, NULL,
+						    mask_commit_delay, false);
+		return;
+	}
+
+	mask_commit_timer = NULL;
+	mask_commit_postponed = false;
+	mask_commit_deferrals = 0;
+
+	list_for_each(item, &peripherals) {
+		peripheral = container_of(item, struct peripheral, node);
+
+		diag_cntl_commit_masks(peripheral);
+	}
+}
+
+/*
+ * Commit the mask updates once the tools have been done updating masks
+ * for a while, or right away if coalescing is disabled.
+ */
+static void diag_cntl_schedule_commit(struct peripheral *peripheral)
+{
+	if (!mask_commit_delay) {
+		diag_cntl_commit_masks(peripheral);
+		return;
+	}
+
+	if (mask_commit_timer) {
+		mask_commit_postponed = true;
+		return;
+	}
+
+	mask_commit_timer = watch_add_timer(diag_cntl_commit_all, NULL,
+					    mask_commit_delay, false);
+}
+
+/**
+ * diag_cntl_set_commit_delay() - set the window for coalescing mask updates
+ * @delay:	delay, in milliseconds, 0 to send each update right away
+ */
+void diag_cntl_set_commit_delay(unsigned int delay)
+{
+	mask_commit_delay = delay;
+}
+
+static bool diag_cntl_mask_peripheral(struct peripheral *peripheral)
+{
+	if (peripheral == NULL)
+		return false;
+	if (peripheral->cntl_fd == -1) {
+		warn("Peripheral %s has no control channel. Skipping!\n", peripheral->name);
+		return false;
+	}
+
+	return true;
+}
+
+void diag_cntl_send_log_mask(struct peripheral *peripheral, uint32_t equip_id)
+{
+	struct diag_cntl_sent_masks *sent;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	sent = diag_cntl_sent_masks(peripheral);
+
+	/* An update of all equip IDs invalidates every one of them */
+	if (diag_get_log_mask_status() != DIAG_CTRL_MASK_VALID)
+		sent->log_dirty = BIT(MAX_EQUIP_ID) - 1;
+	else if (equip_id < MAX_EQUIP_ID)
+		sent->log_dirty |= BIT(equip_id);
+
+	diag_cntl_schedule_commit(peripheral);
+}
+
+void diag_cntl_send_msg_mask(struct peripheral *peripheral, struct diag_ssid_range_t *range)
+{
+	struct diag_cntl_sent_masks *sent;
+	int idx;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	sent = diag_cntl_sent_masks(peripheral);
+
+	if (diag_get_msg_mask_status() != DIAG_CTRL_MASK_VALID) {
+		sent->msg_dirty = BIT(MSG_MASK_TBL_CNT) - 1;
+	} else {
+		idx = diag_msg_mask_index(range->ssid_first);
+		if (idx < 0)
+			return;
+
+		sent->msg_dirty |= BIT(idx);
+	}
+
+	diag_cntl_schedule_commit(peripheral);
+}
+
+void diag_cntl_send_masks(struct peripheral *peripheral)
+{
+	struct diag_cntl_sent_masks *sent;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	sent = diag_cntl_sent_masks(peripheral);
+	sent->msg_dirty = BIT(MSG_MASK_TBL_CNT) - 1;
+
+	diag_cntl_schedule_commit(peripheral);
+}
+
+void diag_cntl_send_event_mask(struct peripheral *peripheral)
+{
+	struct diag_cntl_sent_masks *sent;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	sent = diag_cntl_sent_masks(peripheral);
+	sent->event_dirty = true;
+
+	diag_cntl_schedule_commit(peripheral);
+}
+
+static void diag_cntl_preset_msg_mask(struct diag_cntl_batch *batch,
+				      unsigned int id,
+				      const struct diag_preset_rec *rec)
+{
+	struct diag_cntl_cmd_preset_msg_mask *pkt;
+	size_t len = sizeof(*pkt) + rec->len;
+
+	pkt = alloca(len);
+
+	pkt->hdr.cmd = DIAG_CNTL_CMD_MSG_MASK_WITH_PRESET_ID;
+	pkt->hdr.len = len - sizeof(struct diag_cntl_hdr);
+	pkt->stream_id = 1;
+	pkt->preset_id = id;
+	pkt->status = DIAG_CTRL_MASK_VALID;
+	pkt->msg_mode = 0;
+	pkt->range.ssid_first = rec->id;
+	pkt->range.ssid_last = rec->id + rec->num_items - 1;
+	pkt->msg_mask_len = rec->num_items;
+	memcpy(pkt->range_msg_mask, rec->data, rec->len);
+
+	diag_cntl_batch_add(batch, pkt, len);
+}
+
+static void diag_cntl_preset_log_mask(struct diag_cntl_batch *batch,
+				      unsigned int id,
+				      const struct diag_preset_rec *rec)
+{
+	struct diag_cntl_cmd_preset_log_mask *pkt;
+	size_t len = sizeof(*pkt) + rec->len;
+
+	pkt = alloca(len);
+
+	pkt->hdr.cmd = DIAG_CNTL_CMD_LOG_MASK_WITH_PRESET_ID;
+	pkt->hdr.len = len - sizeof(struct diag_cntl_hdr);
+	pkt->stream_id = 1;
+	pkt->preset_id = id;
+	pkt->status = DIAG_CTRL_MASK_VALID;
+	pkt->equip_id = rec->id;
+	pkt->last_item = rec->num_items;
+	pkt->log_mask_size = rec->len;
+	memcpy(pkt->equip_log_mask, rec->data, rec->len);
+
+	diag_cntl_batch_add(batch, pkt, len);
+}
+
+static void diag_cntl_preset_event_mask(struct diag_cntl_batch *batch,
+					unsigned int id,
+					const struct diag_preset_rec *rec)
+{
+	struct diag_cntl_cmd_preset_event_mask *pkt;
+	size_t len = sizeof(*pkt) + rec->len;
+
+	pkt = alloca(len);
+
+	pkt->hdr.cmd = DIAG_CNTL_CMD_EVENT_MASK_WITH_PRESET_ID;
+	pkt->hdr.len = len - sizeof(struct diag_cntl_hdr);
+	pkt->stream_id = 1;
+	pkt->preset_id = id;
+	pkt->status = DIAG_CTRL_MASK_VALID;
+	pkt->event_config = rec->num_items ? 0x1 : 0x0;
+	pkt->event_mask_len = rec->len;
+	memcpy(pkt->event_mask, rec->data, rec->len);
+
+	diag_cntl_batch_add(batch, pkt, len);
+}
+
+/**
+ * diag_cntl_set_preset() - switch a peripheral to one of its presets
+ * @peripheral:	peripheral to switch
+ * @id:		preset id, starting at 1
+ *
+ * Presets the peripheral wasn't handed, or doesn't support, are ignored.
+ *
+ * The preset replaces the peripheral's masks without touching the router's
+ * own, so the GET_*_MASK responses and the peripherals without preset
+ * support stay on the regular masks. As the peripheral no longer holds what
+ * it was last sent, the next update of each regular mask is sent in full.
+ */
+void diag_cntl_set_preset(struct peripheral *peripheral, unsigned int id)
+{
+	struct diag_cntl_cmd_set_preset_id pkt;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	if (!peripheral->presets_sent || !id || id > peripheral->num_presets)
+		return;
+
+	pkt.hdr.cmd = DIAG_CNTL_CMD_SET_PRESET_ID;
+	pkt.hdr.len = sizeof(pkt) - sizeof(struct diag_cntl_hdr);
+	pkt.preset_id = id;
+
+	queue_push(&peripheral->cntlq, &pkt, sizeof(pkt));
+
+	diag_cntl_sent_clear(peripheral);
+}
+
+/*
+ * Hand the mask presets to the peripheral, once it has advertised support
+ * for them and told how many it can hold, so that switching between them
+ * later on takes a single SET_PRESET_ID.
+ */
+static void diag_cntl_send_presets(struct peripheral *peripheral)
+{
+	const struct diag_preset_rec *rec;
+	struct diag_cntl_batch *batch;
+	unsigned int count;
+	unsigned int id;
+
+	if (!(peripheral->features & DIAG_FEATURE_DIAG_PRESET_MASKS))
+		return;
+
+	if (!peripheral->num_presets || peripheral->presets_sent)
+		return;
+
+	if (!diag_cntl_mask_peripheral(peripheral))
+		return;
+
+	count = MIN(diag_presets_count(), peripheral->num_presets);
+	if (count < diag_presets_count())
+		warnx("[%s] holds only %u of %u mask presets", peripheral->name,
+		      count, diag_presets_count());
+
+	batch = malloc(sizeof(*batch));
+	if (!batch)
+		err(1, "failed to allocate mask batch");
+
+	batch->peripheral = peripheral;
+	batch->len = 0;
+
+	for (id = 1; id <= count; id++) {
+		rec = NULL;
+		while ((rec = diag_preset_next(id, rec)) != NULL) {
+			switch (rec->type) {
+			case DIAG_PRESET_REC_MSG:
+				diag_cntl_preset_msg_mask(batch, id, rec);
+				break;
+			case DIAG_PRESET_REC_LOG:
+				diag_cntl_preset_log_mask(batch, id, rec);
+				break;
+			case DIAG_PRESET_REC_EVENT:
+				diag_cntl_preset_event_mask(batch, id, rec);
+				break;
+			}
+		}
+	}
+
+	diag_cntl_batch_flush(batch);
+	free(batch);
+
+	peripheral->presets_sent = true;
+
+	diag_cntl_set_preset(peripheral, diag_preset_active());
 }
 
 static int diag_cntl_deregister(struct peripheral *peripheral,
 			      struct diag_cntl_hdr *hdr, size_t len)
 {
 	struct diag_cntl_cmd_dereg *pkt = to_cmd_dereg(hdr);
-	struct diag_cmd *dc;
 	unsigned int subsys;
 	unsigned int cmd;
 	unsigned int first;
 	unsigned int last;
 	int i;
-	struct list_head *item;
-	struct list_head *next;
 
 	for (i = 0; i < pkt->count_entries; i++) {
 		cmd = pkt->cmd;
@@ -485,12 +1027,7 @@ static int diag_cntl_deregister(struct peripheral *peripheral,
 		first = cmd << 24 | subsys << 16 | pkt->ranges[i].first;
 		last = cmd << 24 | subsys << 16 | pkt->ranges[i].last;
 
-		list_for_each_safe(item, next, &diag_cmds) {
-			dc = container_of(item, struct diag_cmd, node);
-			if (dc->peripheral == peripheral && dc->first == first && dc->last == last) {
-				list_del(&dc->node);
-			}
-		}
+		cmd_table_remove(&diag_cmds, first, last, peripheral);
 	}
 
 	return 0;
@@ -515,7 +1052,9 @@ static void diag_cntl_send_feature_mask(struct peripheral *peripheral, uint32_t
 
 	queue_push(&peripheral->cntlq, pkt, len);
 	/*send other control packets after sending feature mask */
+	diag_cntl_sent_clear(peripheral);
 	diag_cntl_send_masks(peripheral);
+	diag_cntl_commit_masks(peripheral);
 	diag_cntl_set_diag_mode(peripheral, true);
 	diag_cntl_set_buffering_mode(peripheral, 0);
 }
@@ -714,6 +1253,7 @@ int diag_cntl_recv(struct peripheral *peripheral, const void *buf, size_t n)
 			diag_cntl_process_diag_id(peripheral, hdr, n);
 			break;
 		case DIAG_CNTL_CMD_NUM_PRESETS:
+			diag_cntl_num_presets(peripheral, hdr, n);
 			break;
 		case DIAG_CNTL_CMD_DEREGISTER:
 			diag_cntl_deregister(peripheral, hdr, n);
@@ -733,13 +1273,8 @@ int diag_cntl_recv(struct peripheral *peripheral, const void *buf, size_t n)
 
 void diag_cntl_close(struct peripheral *peripheral)
 {
-	struct list_head *item;
-	struct list_head *next;
-	struct diag_cmd *dc;
-
-	list_for_each_safe(item, next, &diag_cmds) {
-		dc = container_of(item, struct diag_cmd, node);
-		if (dc->peripheral == peripheral)
-			list_del(&dc->node);
-	}
+	cmd_table_remove_peripheral(&diag_cmds, peripheral);
+	diag_cntl_sent_reset(peripheral);
+	peripheral->num_presets = 0;
+	peripheral->presets_sent = false;
 }
@@ -43,6 +43,9 @@
 #define DIAG_MAX_REQ_SIZE	(16 * 1024)
 #define DIAG_MAX_RSP_SIZE	(16 * 1024)
 
+/* Window for coalescing mask updates to the peripherals, in ms */
+#define DIAG_CNTL_DEFAULT_COMMIT_DELAY	20
+
 struct diag_id_info
 {
 	uint8_t diag_id;
@@ -63,6 +66,9 @@ void diag_cntl_send_event_mask(struct peripheral *peripheral);
 void diag_cntl_close(struct peripheral *peripheral);
 
 void diag_cntl_send_masks(struct peripheral *peripheral);
+void diag_cntl_commit_masks(struct peripheral *peripheral);
+void diag_cntl_set_commit_delay(unsigned int delay);
+void diag_cntl_set_preset(struct peripheral *peripheral, unsigned int id);
 
 void diag_cntl_set_diag_mode(struct peripheral *perif, bool real_time);
 void diag_cntl_set_buffering_mode(struct peripheral *perif, int mode);
@@ -32,18 +32,45 @@
 
 #include <err.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "diag.h"
 #include "dm.h"
+#include "mbuf.h"
+#include "util.h"
 #include "watch.h"
 
 /**
  * DOC: Diagnostic Monitor
  */
 
+/* Default limits of the output queue of each DM */
+#define DM_QUEUE_BYTES		(4 * 1024 * 1024)
+#define DM_QUEUE_PACKETS	4096
+
+#define DIAG_CMD_EVENT_REPORT	0x60
+#define DM_EVENT_DROP_ID	0
+
+/* Event report payload with a length byte, and full timestamp */
+#define DM_EVENT_PAYLOAD_LEN	(3 << 13)
+
+/*
+ * In-band marker queued to a DM ahead of the first message following a
+ * loss. It carries the running total of messages dropped for the DM, so that
+ * the count of the gap remains known should a marker be dropped itself.
+ */
+struct dm_drop_event {
+	uint8_t cmd_code;
+	uint16_t length;
+	uint16_t id;
+	uint64_t timestamp;
+	uint8_t payload_len;
+	uint32_t dropped;
+} __packed;
+
 struct diag_client {
 	const char *name;
 	int fd;
@@ -58,6 +85,16 @@ struct diag_client {
 	struct hdlc_decoder recv_decoder;
 
 	struct list_head outq;
+	struct list_head respq;
+	struct mbuf_account queued;
+	size_t max_bytes;
+	unsigned int max_packets;
+	enum dm_queue_policy policy;
+
+	unsigned long dropped;
+	unsigned long dropped_bytes;
+	bool lost;
+
 	struct list_head node;
 };
 
@@ -65,9 +102,14 @@ struct list_head diag_clients = LIST_INIT(diag_clients);
 
 /**
  * dm_add() - register new DM
- * @dm:		DM object to register
+ * @name:	name of the DM
+ * @in_fd:	file descriptor to read commands from, or -1
+ * @out_fd:	file descriptor to write responses and logs to
+ * @hdlc_encoded: whether or not the DM uses HDLC framing
+ * @recv_size:	size of the buffer for HDLC framed commands from @in_fd
  */
-struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool hdlc_encoded)
+struct diag_client *dm_add(const char *name, int in_fd, int out_fd,
+			   bool hdlc_encoded, size_t recv_size)
 {
 	struct diag_client *dm;
 
@@ -80,10 +122,22 @@ struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool hdlc_en
 	dm->out_fd = out_fd;
 	dm->hdlc_encoded = hdlc_encoded;
 	list_init(&dm->outq);
+	list_init(&dm->respq);
+
+	dm->max_bytes = DM_QUEUE_BYTES;
+	dm->max_packets = DM_QUEUE_PACKETS;
+	dm->policy = DM_DROP_OLDEST;
+
+	/* Raw DMs read straight into a stack buffer */
+	if (in_fd >= 0 && hdlc_encoded) {
+		if (circ_init(&dm->recv_buf, recv_size) < 0)
+			err(1, "failed to allocate DM receive buffer");
+	}
 
 	if (dm->in_fd >= 0)
 		watch_add_readfd(dm->in_fd, dm_recv, dm, NULL);
 	watch_add_writeq(dm->out_fd, &dm->outq);
+	watch_set_priority_queue(dm->out_fd, &dm->respq);
 
 	list_add(&diag_clients, &dm->node);
 
@@ -163,29 +217,225 @@ int dm_recv(int fd, void* data)
 		return dm_recv_raw(dm);
 }
 
-static ssize_t dm_send_flow(struct diag_client *dm, const void *ptr, size_t len,
-			    struct watch_flow *flow)
+/**
+ * struct dm_msg - message to be sent, in one or both of its forms
+ * @raw:	raw message, or NULL
+ * @raw_len:	length of @raw
+ * @hdlc:	validated HDLC frame of the message, or NULL
+ * @hdlc_len:	length of @hdlc
+ */
+struct dm_msg {
+	const void *raw;
+	size_t raw_len;
+
+	const void *hdlc;
+	size_t hdlc_len;
+};
+
+static struct mbuf *dm_copy(const void *ptr, size_t len)
 {
-	if (!dm->enabled)
-		return 0;
+	struct mbuf *mbuf;
 
-	if (dm->hdlc_encoded)
-		hdlc_enqueue_flow(&dm->outq, ptr, len, flow);
-	else
-		queue_push_flow(&dm->outq, ptr, len, flow);
+	mbuf = mbuf_alloc(len);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
 
-	return 0;
+	memcpy(mbuf_put(mbuf, len), ptr, len);
+
+	return mbuf;
+}
+
+/* Wrap a message in an mbuf, framed as expected by @dm */
+static struct mbuf *dm_frame(struct diag_client *dm, const struct dm_msg *msg)
+{
+	struct mbuf *mbuf;
+	size_t len;
+
+	if (dm->hdlc_encoded) {
+		if (msg->hdlc)
+			return dm_copy(msg->hdlc, msg->hdlc_len);
+
+		return hdlc_encode_mbuf(msg->raw, msg->raw_len);
+	}
+
+	if (msg->raw)
+		return dm_copy(msg->raw, msg->raw_len);
+
+	/* Only decode a passed through frame for the clients needing it */
+	mbuf = mbuf_alloc_room(0, 0, msg->hdlc_len);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
+	len = hdlc_unframe(mbuf->data, msg->hdlc, msg->hdlc_len);
+	mbuf_put(mbuf, len);
+
+	return mbuf;
+}
+
+static bool dm_queue_full(struct diag_client *dm, size_t len)
+{
+	return dm->queued.packets >= dm->max_packets ||
+	       dm->queued.bytes + len > dm->max_bytes;
+}
+
+static void dm_drop(struct diag_client *dm, struct mbuf *mbuf)
+{
+	dm->dropped++;
+	dm->dropped_bytes += mbuf->size;
+	dm->lost = true;
+
+	mbuf_free(mbuf);
+}
+
+/*
+ * The drop event is not charged to the queue, so it's not dropped by a later
+ * loss, nor counted as one.
+ */
+static void dm_queue_drop_event(struct diag_client *dm)
+{
+	struct dm_drop_event ev = {
+		.cmd_code = DIAG_CMD_EVENT_REPORT,
+		.length = sizeof(ev) - offsetof(struct dm_drop_event, id),
+		.id = DM_EVENT_PAYLOAD_LEN | DM_EVENT_DROP_ID,
+		.payload_len = sizeof(ev.dropped),
+		.dropped = dm->dropped,
+	};
+	struct dm_msg msg = { .raw = &ev, .raw_len = sizeof(ev) };
+
+	queue_push_mbuf(&dm->outq, dm_frame(dm, &msg), NULL);
+
+	dm->lost = false;
+}
+
+/* Drop the oldest messages not yet handed to the watch to fit @len bytes */
+static bool dm_drop_oldest(struct diag_client *dm, size_t len)
+{
+	struct mbuf *oldest;
+	struct mbuf *next;
+	bool dropped = false;
+
+	list_for_each_entry_safe(oldest, next, &dm->outq, node) {
+		if (!dm_queue_full(dm, len))
+			break;
+
+		/* Skip drop events and aggregates formed by the watch */
+		if (oldest->account != &dm->queued)
+			continue;
+
+		list_del(&oldest->node);
+		dm_drop(dm, oldest);
+		dropped = true;
+	}
+
+	return dropped;
+}
+
+/*
+ * Queue @mbuf to @dm, within the limits of its queue. @flow is only charged
+ * for messages exceeding the limits of a DM blocking the peripheral, so a
+ * DM keeping up never holds back the peripheral, and with it every other DM.
+ *
+ * A drop event is queued once a message fits without dropping any other,
+ * so that a sustained loss yields one event rather than one per message.
+ */
+static void dm_queue(struct diag_client *dm, struct mbuf *mbuf,
+		     struct watch_flow *flow)
+{
+	bool dropped = false;
+
+	if (dm->policy == DM_BLOCK_PERIPHERAL) {
+		if (!dm_queue_full(dm, mbuf->size))
+			flow = NULL;
+
+		mbuf_charge(mbuf, &dm->queued);
+		queue_push_mbuf(&dm->outq, mbuf, flow);
+		return;
+	}
+
+	if (dm->policy == DM_DROP_OLDEST)
+		dropped = dm_drop_oldest(dm, mbuf->size);
+
+	if (dm_queue_full(dm, mbuf->size)) {
+		dm_drop(dm, mbuf);
+		return;
+	}
+
+	if (dm->lost && !dropped)
+		dm_queue_drop_event(dm);
+
+	mbuf_charge(mbuf, &dm->queued);
+	queue_push_mbuf(&dm->outq, mbuf, NULL);
+}
+
+/*
+ * Command responses are queued on a lane of their own, written ahead of the
+ * log data, so that tools awaiting them don't time out behind a backlog of
+ * logs. They are few and small, so they aren't subject to the limits.
+ */
+static void dm_queue_response(struct diag_client *dm, struct mbuf *mbuf)
+{
+	mbuf_charge(mbuf, &dm->queued);
+	queue_push_mbuf(&dm->respq, mbuf, NULL);
 }
 
 /**
- * dm_send() - enqueue message to DM
+ * dm_send() - enqueue command response to DM
  * @dm:		dm to be receiving the message
  * @ptr:	pointer to raw message to be sent
  * @len:	length of message
  */
 ssize_t dm_send(struct diag_client *dm, const void *ptr, size_t len)
 {
-	return dm_send_flow(dm, ptr, len, NULL);
+	struct dm_msg msg = { .raw = ptr, .raw_len = len };
+
+	if (!dm->enabled)
+		return 0;
+
+	dm_queue_response(dm, dm_frame(dm, &msg));
+
+	return 0;
+}
+
+/*
+ * The message is framed once per framing type and each client is queued a
+ * clone of it. @raw, if given, is used as is for clients not expecting HDLC.
+ *
+ * The broadcast holds its own reference to the framed mbufs until all
+ * clients are served, as a client may drop, and so free, its copy right
+ * away; and @raw also backs the message framed for HDLC clients.
+ */
+static void dm_broadcast_framed(const struct dm_msg *msg, struct mbuf *raw,
+				struct watch_flow *flow, bool response)
+{
+	struct mbuf *framed[2] = { raw, NULL };
+	struct diag_client *dm;
+	struct list_head *item;
+	struct mbuf *mbuf;
+	int type;
+
+	list_for_each(item, &diag_clients) {
+		dm = container_of(item, struct diag_client, node);
+		if (!dm->enabled)
+			continue;
+
+		type = dm->hdlc_encoded;
+		if (!framed[type])
+			framed[type] = dm_frame(dm, msg);
+
+		mbuf = mbuf_clone(framed[type]);
+		if (!mbuf)
+			err(1, "failed to clone mbuf");
+
+		if (response)
+			dm_queue_response(dm, mbuf);
+		else
+			dm_queue(dm, mbuf, flow);
+	}
+
+	for (type = 0; type < 2; type++) {
+		if (framed[type])
+			mbuf_free(framed[type]);
+	}
 }
 
 /**
@@ -195,14 +445,137 @@ ssize_t dm_send(struct diag_client *dm, const void *ptr, size_t len)
  * @flow:	flow control context for the peripheral
  */
 void dm_broadcast(const void *ptr, size_t len, struct watch_flow *flow)
+{
+	struct dm_msg msg = { .raw = ptr, .raw_len = len };
+
+	dm_broadcast_framed(&msg, NULL, flow, false);
+}
+
+/**
+ * dm_broadcast_mbuf() - send message in an mbuf to all registered DMs
+ * @mbuf:	mbuf holding the raw message, ownership is transferred
+ * @flow:	flow control context for the peripheral
+ *
+ * The mbuf is queued, without copying, to the DMs not expecting HDLC.
+ */
+void dm_broadcast_mbuf(struct mbuf *mbuf, struct watch_flow *flow)
+{
+	struct dm_msg msg = { .raw = mbuf->data, .raw_len = mbuf->size };
+
+	dm_broadcast_framed(&msg, mbuf, flow, false);
+}
+
+/**
+ * dm_response_alloc() - allocate a response to be built in place
+ * @len:	length of the response
+ *
+ * The response is meant to be sent with dm_send_mbuf(), which queues it
+ * as is to clients not expecting HDLC framing.
+ *
+ * Return: mbuf holding @len bytes of uninitialized payload, NULL if out of
+ * memory
+ */
+struct mbuf *dm_response_alloc(size_t len)
+{
+	struct mbuf *mbuf;
+
+	mbuf = mbuf_alloc(len);
+	if (!mbuf) {
+		warn("failed to allocate response");
+		return NULL;
+	}
+
+	mbuf_put(mbuf, len);
+
+	return mbuf;
+}
+
+/**
+ * dm_send_mbuf() - enqueue command response in an mbuf to DM
+ * @dm:		dm to be receiving the response
+ * @mbuf:	mbuf holding the raw response, ownership is transferred
+ */
+void dm_send_mbuf(struct diag_client *dm, struct mbuf *mbuf)
+{
+	struct mbuf *framed = mbuf;
+
+	if (!dm->enabled) {
+		mbuf_free(mbuf);
+		return;
+	}
+
+	if (dm->hdlc_encoded) {
+		framed = hdlc_encode_mbuf(mbuf->data, mbuf->size);
+		mbuf_free(mbuf);
+	}
+
+	dm_queue_response(dm, framed);
+}
+
+/**
+ * dm_broadcast_response() - send command response to all registered DMs
+ * @mbuf:	mbuf holding the raw response, ownership is transferred
+ *
+ * Like dm_broadcast_mbuf(), but the response is queued ahead of log data.
+ */
+void dm_broadcast_response(struct mbuf *mbuf)
+{
+	struct dm_msg msg = { .raw = mbuf->data, .raw_len = mbuf->size };
+
+	dm_broadcast_framed(&msg, mbuf, NULL, true);
+}
+
+/**
+ * dm_broadcast_hdlc() - pass an HDLC frame through to all registered DMs
+ * @frame:	validated HDLC frame, as returned from hdlc_frame_one()
+ * @len:	length of @frame
+ * @flow:	flow control context for the peripheral
+ *
+ * The frame is forwarded as is to DMs expecting HDLC, and only decoded if
+ * there are DMs which don't.
+ */
+void dm_broadcast_hdlc(const void *frame, size_t len, struct watch_flow *flow)
+{
+	struct dm_msg msg = { .hdlc = frame, .hdlc_len = len };
+
+	dm_broadcast_framed(&msg, NULL, flow, false);
+}
+
+/**
+ * dm_set_queue_limit() - configure the output queue of a DM
+ * @dm:		DM to configure
+ * @bytes:	maximum number of bytes queued to @dm
+ * @packets:	maximum number of messages queued to @dm
+ * @policy:	handling of messages exceeding the limits
+ *
+ * The limits cover messages queued, not yet aggregated: once packed into a
+ * transfer, messages are no longer counted, so up to one transfer per
+ * in-flight request comes on top of @bytes. Messages dropped are
+ * counted per DM and signalled in-band, by a drop event ahead of the next
+ * message queued. With DM_BLOCK_PERIPHERAL nothing is dropped; messages
+ * exceeding the limits are charged to the flow control context of their
+ * peripheral instead, which stops reading from the peripheral as @dm falls
+ * further behind.
+ */
+void dm_set_queue_limit(struct diag_client *dm, size_t bytes,
+			unsigned int packets, enum dm_queue_policy policy)
+{
+	dm->max_bytes = bytes;
+	dm->max_packets = packets;
+	dm->policy = policy;
+}
+
+void dm_stats(FILE *fp)
 {
 	struct diag_client *dm;
-	struct list_head *item;
 
-	list_for_each(item, &diag_clients) {
-		dm = container_of(item, struct diag_client, node);
+	fprintf(fp, "%-16s %10s %8s %10s %12s\n",
+		"client", "queued", "packets", "dropped", "dropped bytes");
 
-		dm_send_flow(dm, ptr, len, flow);
+	list_for_each_entry(dm, &diag_clients, node) {
+		fprintf(fp, "%-16s %10zu %8u %10lu %12lu\n",
+			dm->name, dm->queued.bytes, dm->queued.packets,
+			dm->dropped, dm->dropped_bytes);
 	}
 }
 
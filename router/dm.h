@@ -32,14 +32,37 @@
 #ifndef __DM_H__
 #define __DM_H__
 
+#include <stdio.h>
+
 #include "diag.h"
 
 struct diag_client;
 
-struct diag_client *dm_add(const char *name, int in_fd, int out_fd, bool hdlc_encoded);
+/**
+ * enum dm_queue_policy - handling of messages to a DM with a full queue
+ * @DM_DROP_OLDEST:	drop the oldest messages not yet being written
+ * @DM_DROP_NEWEST:	drop the message being queued
+ * @DM_BLOCK_PERIPHERAL: never drop, hold back the originating peripheral
+ */
+enum dm_queue_policy {
+	DM_DROP_OLDEST,
+	DM_DROP_NEWEST,
+	DM_BLOCK_PERIPHERAL,
+};
+
+struct diag_client *dm_add(const char *name, int in_fd, int out_fd,
+			   bool hdlc_encoded, size_t recv_size);
 int dm_recv(int fd, void* data);
 ssize_t dm_send(struct diag_client *dm, const void *ptr, size_t len);
+struct mbuf *dm_response_alloc(size_t len);
+void dm_send_mbuf(struct diag_client *dm, struct mbuf *mbuf);
 void dm_broadcast(const void *ptr, size_t len, struct watch_flow *flow);
+void dm_broadcast_mbuf(struct mbuf *mbuf, struct watch_flow *flow);
+void dm_broadcast_response(struct mbuf *mbuf);
+void dm_broadcast_hdlc(const void *frame, size_t len, struct watch_flow *flow);
+void dm_set_queue_limit(struct diag_client *dm, size_t bytes,
+			unsigned int packets, enum dm_queue_policy policy);
+void dm_stats(FILE *fp);
 void dm_enable(struct diag_client *dm);
 void dm_disable(struct diag_client *dm);
 
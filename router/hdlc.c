@@ -28,9 +28,18 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "crc16.h"
 #include "hdlc.h"
 #include "util.h"
 
@@ -38,128 +47,568 @@
  * HDLC frame check is performed by a reversed CRC-CCITT-16 with polynomial
  * x^16 + x^12 + x^5 + 1 (0x8408), an initial value of 0xffff and the result
  * XORed with 0xffff.
+ */
+#define HDLC_FCS_GOOD	0x0f47
+
+static uint16_t hdlc_crc(const uint8_t *s, size_t len)
+{
+	return ~crc16(0xffff, s, len);
+}
+
+/*
+ * The encoder spends most of its time looking for the 0x7d and 0x7e bytes
+ * which need escaping, so this is done 16 or 32 bytes at a time using the
+ * vector unit, where available, and the runs in between are bulk copied.
+ */
+static inline bool hdlc_needs_escape(uint8_t ch)
+{
+	return ch == 0x7d || ch == 0x7e;
+}
+
+static size_t hdlc_find_escape_scalar(const uint8_t *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (hdlc_needs_escape(s[i]))
+			break;
+	}
+
+	return i;
+}
+
+static size_t hdlc_count_escapes_scalar(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count += hdlc_needs_escape(s[i]);
+
+	return count;
+}
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HDLC_SCAN_X86 1
+
+static inline __m128i hdlc_escape_mask_sse2(const uint8_t *s)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)s);
+
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7d)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7e)));
+}
+
+static size_t hdlc_find_escape_sse2(const uint8_t *s, size_t len)
+{
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(hdlc_escape_mask_sse2(s + i));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + hdlc_find_escape_scalar(s + i, len - i);
+}
+
+static size_t hdlc_count_escapes_sse2(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		count += __builtin_popcount(_mm_movemask_epi8(hdlc_escape_mask_sse2(s + i)));
+
+	return count + hdlc_count_escapes_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hdlc_escape_mask_avx2(const uint8_t *s)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)s);
+
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7d)),
+			       _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7e)));
+}
+
+__attribute__((target("avx2")))
+static size_t hdlc_find_escape_avx2(const uint8_t *s, size_t len)
+{
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(hdlc_escape_mask_avx2(s + i));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + hdlc_find_escape_sse2(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t hdlc_count_escapes_avx2(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		count += __builtin_popcount(_mm256_movemask_epi8(hdlc_escape_mask_avx2(s + i)));
+
+	return count + hdlc_count_escapes_sse2(s + i, len - i);
+}
+
+#elif defined(__aarch64__)
+#define HDLC_SCAN_NEON 1
+
+static inline uint8x16_t hdlc_escape_mask_neon(const uint8_t *s)
+{
+	uint8x16_t v = vld1q_u8(s);
+
+	return vorrq_u8(vceqq_u8(v, vdupq_n_u8(0x7d)),
+			vceqq_u8(v, vdupq_n_u8(0x7e)));
+}
+
+static size_t hdlc_find_escape_neon(const uint8_t *s, size_t len)
+{
+	uint64_t mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		/* Narrow the byte mask to a nibble per byte */
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hdlc_escape_mask_neon(s + i)), 4)), 0);
+		if (mask)
+			return i + __builtin_ctzll(mask) / 4;
+	}
+
+	return i + hdlc_find_escape_scalar(s + i, len - i);
+}
+
+static size_t hdlc_count_escapes_neon(const uint8_t *s, size_t len)
+{
+	size_t count = 0;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		count += vaddvq_u8(vandq_u8(hdlc_escape_mask_neon(s + i), vdupq_n_u8(1)));
+
+	return count + hdlc_count_escapes_scalar(s + i, len - i);
+}
+#endif
+
+static size_t (*hdlc_find_escape)(const uint8_t *s, size_t len);
+static size_t (*hdlc_count_escapes)(const uint8_t *s, size_t len);
+
+static void hdlc_scan_init(void)
+{
+#if HDLC_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		hdlc_find_escape = hdlc_find_escape_avx2;
+		hdlc_count_escapes = hdlc_count_escapes_avx2;
+	} else {
+		hdlc_find_escape = hdlc_find_escape_sse2;
+		hdlc_count_escapes = hdlc_count_escapes_sse2;
+	}
+#elif HDLC_SCAN_NEON
+	hdlc_find_escape = hdlc_find_escape_neon;
+	hdlc_count_escapes = hdlc_count_escapes_neon;
+#else
+	hdlc_find_escape = hdlc_find_escape_scalar;
+	hdlc_count_escapes = hdlc_count_escapes_scalar;
+#endif
+}
+
+static uint8_t *hdlc_escape(uint8_t *d, const uint8_t *s, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = hdlc_find_escape(s, len);
+		memcpy(d, s, n);
+		d += n;
+		s += n;
+		len -= n;
+
+		if (!len)
+			break;
+
+		*d++ = 0x7d;
+		*d++ = *s++ ^ 0x20;
+		len--;
+	}
+
+	return d;
+}
+
+/**
+ * hdlc_encode_size() - calculate space needed to HDLC encode a message
+ * @src:	message to be encoded
+ * @slen:	length of @src
+ *
+ * Return: upper bound of the encoded size of @src, accurate except for the
+ * escaping of the CRC, which is assumed to be needed
+ */
+size_t hdlc_encode_size(const void *src, size_t slen)
+{
+	if (!hdlc_count_escapes)
+		hdlc_scan_init();
+
+	return slen + hdlc_count_escapes(src, slen) + 2 * 2 + 1;
+}
+
+/**
+ * hdlc_encode() - HDLC encode a message
+ * @dst:	destination buffer, of at least hdlc_encode_size() bytes
+ * @src:	message to be encoded
+ * @slen:	length of @src
  *
- * Calculation is performed with a table lookup as described in
- * http://www.ross.net/crc/download/crc_v3.txt
+ * Return: number of bytes written to @dst
  */
-static uint16_t crc_table[256] = {
-	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf, 0x8c48,
-	0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7, 0x1081, 0x0108,
-	0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e, 0x9cc9, 0x8d40, 0xbfdb,
-	0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876, 0x2102, 0x308b, 0x0210, 0x1399,
-	0x6726, 0x76af, 0x4434, 0x55bd, 0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e,
-	0xfae7, 0xc87c, 0xd9f5, 0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e,
-	0x54b5, 0x453c, 0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd,
-	0xc974, 0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3, 0x5285,
-	0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a, 0xdecd, 0xcf44,
-	0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72, 0x6306, 0x728f, 0x4014,
-	0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9, 0xef4e, 0xfec7, 0xcc5c, 0xddd5,
-	0xa96a, 0xb8e3, 0x8a78, 0x9bf1, 0x7387, 0x620e, 0x5095, 0x411c, 0x35a3,
-	0x242a, 0x16b1, 0x0738, 0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862,
-	0x9af9, 0x8b70, 0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e,
-	0xf0b7, 0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036, 0x18c1,
-	0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e, 0xa50a, 0xb483,
-	0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5, 0x2942, 0x38cb, 0x0a50,
-	0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd, 0xb58b, 0xa402, 0x9699, 0x8710,
-	0xf3af, 0xe226, 0xd0bd, 0xc134, 0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7,
-	0x6e6e, 0x5cf5, 0x4d7c, 0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1,
-	0xa33a, 0xb2b3, 0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72,
-	0x3efb, 0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a, 0xe70e,
-	0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1, 0x6b46, 0x7acf,
-	0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9, 0xf78f, 0xe606, 0xd49d,
-	0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330, 0x7bc7, 0x6a4e, 0x58d5, 0x495c,
-	0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
-
-static uint16_t hdlc_crc_byte(uint16_t crc, uint8_t ch)
-{
-	return (crc >> 8) ^ crc_table[(crc ^ ch) & 0xff];
-}
-
-void *hdlc_encode(const void *src, size_t slen, size_t *dlen)
-{
-	const uint8_t *end = src + slen;
-	const uint8_t *s = src;
-	uint16_t crc = 0xffff;
+size_t hdlc_encode(void *dst, const void *src, size_t slen)
+{
 	uint8_t tmp[2];
-	uint8_t *dst;
+	uint16_t crc;
 	uint8_t *d;
-	int i;
 
-	dst = malloc((slen + 2) * 2 + 1);
-	if (!dst)
-		return NULL;
+	if (!hdlc_find_escape)
+		hdlc_scan_init();
 
-	d = dst;
-	while (s < end) {
-		crc = hdlc_crc_byte(crc, *s);
+	crc = hdlc_crc(src, slen);
+	tmp[0] = crc & 0xff;
+	tmp[1] = crc >> 8;
+
+	d = hdlc_escape(dst, src, slen);
+	d = hdlc_escape(d, tmp, sizeof(tmp));
+	*d++ = 0x7e;
+
+	return d - (uint8_t *)dst;
+}
 
-		if (*s == 0x7d || *s == 0x7e) {
-			*d++ = 0x7d;
-			*d++ = *s++ ^ 0x20;
-		} else {
-			*d++ = *s++;
+/* Totals across all decoders, for hdlc_stats() */
+static unsigned long hdlc_bad_frames;
+static unsigned long hdlc_oversized_frames;
+
+/*
+ * Append @len bytes of a frame, without any 0x7e delimiter, to the decoded
+ * message, undoing the escaping of 0x7d and 0x7e. Escape-free spans are
+ * located with memchr() and copied in bulk.
+ */
+static void hdlc_unescape(struct hdlc_decoder *hdlc, const uint8_t *src,
+			  size_t len)
+{
+	const uint8_t *end = src + len;
+	const uint8_t *esc;
+	size_t n;
+
+	while (src < end && !hdlc->discard) {
+		if (hdlc->escape) {
+			if (hdlc->len == HDLC_BUF_SIZE) {
+				hdlc->discard = true;
+				break;
+			}
+
+			hdlc->raw_buf[hdlc->len++] = *src++ ^ 0x20;
+			hdlc->escape = 0;
+			continue;
 		}
+
+		esc = memchr(src, 0x7d, end - src);
+		n = (esc ? esc : end) - src;
+		if (hdlc->len + n > HDLC_BUF_SIZE) {
+			hdlc->discard = true;
+			break;
+		}
+
+		memcpy(hdlc->raw_buf + hdlc->len, src, n);
+		hdlc->len += n;
+		src += n;
+
+		if (esc) {
+			hdlc->escape = 0x20;
+			src++;
+		}
+	}
+}
+
+/*
+ * Append @len bytes of a frame, without any 0x7e delimiter, to the frame
+ * kept for passthrough as is, while running the FCS over the unescaped
+ * content.
+ */
+static void hdlc_passthrough(struct hdlc_decoder *hdlc, const uint8_t *src,
+			     size_t len)
+{
+	const uint8_t *end = src + len;
+	const uint8_t *esc;
+	uint8_t ch;
+	size_t n;
+
+	if (hdlc->discard)
+		return;
+
+	/* Keep room for the terminating delimiter */
+	if (hdlc->len + len >= HDLC_BUF_SIZE) {
+		hdlc->discard = true;
+		return;
 	}
 
-	tmp[0] = ~crc & 0xff;
-	tmp[1] = ~crc >> 8;
+	memcpy(hdlc->raw_buf + hdlc->len, src, len);
+	hdlc->len += len;
 
-	s = tmp;
-	for (i = 0; i < 2; i++) {
-		if (*s == 0x7d || *s == 0x7e) {
-			*d++ = 0x7d;
-			*d++ = *s++ ^ 0x20;
-		} else {
-			*d++ = *s++;
+	while (src < end) {
+		if (hdlc->escape) {
+			ch = *src++ ^ 0x20;
+			hdlc->fcs = ~crc16(~hdlc->fcs, &ch, 1);
+			hdlc->msg_len++;
+			hdlc->escape = 0;
+			continue;
+		}
+
+		esc = memchr(src, 0x7d, end - src);
+		n = (esc ? esc : end) - src;
+
+		hdlc->fcs = ~crc16(~hdlc->fcs, src, n);
+		hdlc->msg_len += n;
+		src += n;
+
+		if (esc) {
+			hdlc->escape = 0x20;
+			src++;
 		}
 	}
+}
 
-	*d++ = 0x7e;
-	*dlen = d - dst;
+/* Validate the frame and its FCS, counting the ones rejected */
+static bool hdlc_frame_valid(struct hdlc_decoder *hdlc, bool passthrough)
+{
+	uint16_t fcs;
+
+	if (hdlc->discard) {
+		hdlc->oversized++;
+		hdlc_oversized_frames++;
+		return false;
+	}
+
+	if ((passthrough ? hdlc->msg_len : hdlc->len) <= 2)
+		goto bad;
+
+	if (passthrough) {
+		/* The FCS over a message and its own FCS yields a constant */
+		if (hdlc->fcs != HDLC_FCS_GOOD)
+			goto bad;
+	} else {
+		fcs = (uint8_t)hdlc->raw_buf[hdlc->len - 2] |
+		      (uint8_t)hdlc->raw_buf[hdlc->len - 1] << 8;
+		if (hdlc_crc((uint8_t *)hdlc->raw_buf, hdlc->len - 2) != fcs)
+			goto bad;
+	}
 
-	return dst;
+	return true;
+
+bad:
+	hdlc->bad++;
+	hdlc_bad_frames++;
+
+	return false;
 }
 
-void *hdlc_decode_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
-		      size_t *msglen)
+/*
+ * Consume the @count bytes at @data up to the end of the next valid frame,
+ * which is left in the raw buffer of @hdlc, either decoded or, for
+ * @passthrough, as received and including the terminating 0x7e. @count is
+ * updated to the number of bytes consumed. Returns false if @data holds no
+ * further complete frame.
+ */
+static bool hdlc_scan_frame(struct hdlc_decoder *hdlc, const void *data,
+			    size_t *count, bool passthrough, size_t *len)
 {
-	uint8_t ch;
+	const uint8_t *start = data;
+	const uint8_t *end = start + *count;
+	const uint8_t *flag;
+	bool valid;
+	size_t n;
 
-	if (!hdlc->raw)
-		hdlc->raw = hdlc->raw_buf;
+	while (start < end) {
+		n = end - start;
 
-	for (;;) {
-		if (buf->tail == buf->head)
-			return 0;
+		flag = memchr(start, 0x7e, n);
+		if (flag)
+			n = flag - start;
 
-		ch = buf->buf[buf->tail];
-		buf->tail = (buf->tail + 1) & (HDLC_BUF_SIZE - 1);
+		if (passthrough)
+			hdlc_passthrough(hdlc, start, n);
+		else
+			hdlc_unescape(hdlc, start, n);
 
-		if (ch == 0x7e) {
+		start += n;
+		if (!flag)
 			break;
-		} else if (ch == 0x7d) {
-			hdlc->escape = 0x20;
-		} else {
-			*hdlc->raw++ = ch ^ hdlc->escape;
-			hdlc->escape = 0;
+		start++;
+
+		/* Back to back delimiters carry no frame */
+		if (!hdlc->len && !hdlc->discard)
+			continue;
+
+		valid = hdlc_frame_valid(hdlc, passthrough);
+		if (valid && passthrough) {
+			hdlc->raw_buf[hdlc->len] = 0x7e;
+			*len = hdlc->len + 1;
+		} else if (valid) {
+			*len = hdlc->len - 2;
 		}
 
+		hdlc->len = 0;
+		hdlc->msg_len = 0;
+		hdlc->fcs = 0;
+		hdlc->escape = 0;
+		hdlc->discard = false;
+
+		if (valid) {
+			*count = start - (const uint8_t *)data;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Consume @buf up to the end of the next valid frame, scanning up to the
+ * head, or the end of the buffer if wrapped, at a time.
+ */
+static bool hdlc_next_frame(struct hdlc_decoder *hdlc, struct circ_buf *buf,
+			    bool passthrough, size_t *len)
+{
+	bool found;
+	size_t n;
+
+	while (buf->tail != buf->head) {
+		n = CIRC_CNT_TO_END(buf);
+		found = hdlc_scan_frame(hdlc, buf->buf + buf->tail, &n,
+					passthrough, len);
+		buf->tail = (buf->tail + n) & (buf->size - 1);
+
+		if (found)
+			return true;
 	}
 
-	if (hdlc->raw == hdlc->raw_buf)
+	return false;
+}
+
+/**
+ * hdlc_decode_one() - decode the next complete frame from a buffer
+ * @hdlc:	decoder context, carrying partial frames between calls
+ * @buf:	buffer of received data, consumed up to the end of the frame
+ * @msglen:	length of the decoded message
+ *
+ * Frames which fail the FCS check or don't fit the decoder are dropped and
+ * counted in @hdlc.
+ *
+ * Return: the decoded message, without FCS, valid until the next call; NULL
+ * if @buf holds no further complete frame
+ */
+void *hdlc_decode_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
+		      size_t *msglen)
+{
+	if (!hdlc_next_frame(hdlc, buf, false, msglen))
 		return NULL;
 
-	hdlc->raw--;
-	hdlc->raw--;
+	return hdlc->raw_buf;
+}
+
+/**
+ * hdlc_decode_buf() - decode the next complete frame from a linear buffer
+ * @hdlc:	decoder context, carrying partial frames between calls
+ * @data:	pointer to the received data, advanced past the frame
+ * @count:	number of bytes at @data, reduced by the amount consumed
+ * @msglen:	length of the decoded message
+ *
+ * Like hdlc_decode_one(), but decoding straight from the buffer the data was
+ * received into. Data following the last complete frame is consumed into
+ * @hdlc, so the buffer may be reused once NULL is returned.
+ *
+ * Return: the decoded message, without FCS, valid until the next call; NULL
+ * if @data holds no further complete frame
+ */
+void *hdlc_decode_buf(struct hdlc_decoder *hdlc, const void **data,
+		      size_t *count, size_t *msglen)
+{
+	size_t n = *count;
+	bool found;
+
+	found = hdlc_scan_frame(hdlc, *data, &n, false, msglen);
+	*data = (const uint8_t *)*data + n;
+	*count -= n;
 
-	*msglen = hdlc->raw - hdlc->raw_buf;
+	return found ? hdlc->raw_buf : NULL;
+}
 
-	hdlc->raw = hdlc->raw_buf;
-	hdlc->escape = 0;
+/**
+ * hdlc_frame_one() - extract the next complete frame from a buffer, as is
+ * @hdlc:	decoder context, carrying partial frames between calls
+ * @buf:	buffer of received data, consumed up to the end of the frame
+ * @framelen:	length of the frame, including FCS and terminating 0x7e
+ *
+ * Like hdlc_decode_one(), but the frame is validated without being decoded,
+ * for passing it on to HDLC consumers; hdlc_unframe() decodes it if needed.
+ * The escaped frame must fit the decoder.
+ *
+ * Return: the frame, valid until the next call; NULL if @buf holds no
+ * further complete frame
+ */
+void *hdlc_frame_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
+		     size_t *framelen)
+{
+	if (!hdlc_next_frame(hdlc, buf, true, framelen))
+		return NULL;
 
 	return hdlc->raw_buf;
 }
+
+/**
+ * hdlc_unframe() - decode a frame returned from hdlc_frame_one()
+ * @dst:	destination buffer, of at least @framelen bytes
+ * @frame:	HDLC frame
+ * @framelen:	length of @frame
+ *
+ * Return: length of the message decoded into @dst, without FCS
+ */
+size_t hdlc_unframe(void *dst, const void *frame, size_t framelen)
+{
+	const uint8_t *end = (const uint8_t *)frame + framelen;
+	const uint8_t *s = frame;
+	const uint8_t *esc;
+	uint8_t *d = dst;
+	size_t n;
+
+	if (framelen && end[-1] == 0x7e)
+		end--;
+
+	while (s < end) {
+		esc = memchr(s, 0x7d, end - s);
+		n = (esc ? esc : end) - s;
+		memcpy(d, s, n);
+		d += n;
+		s += n;
+
+		if (esc && s + 1 < end) {
+			*d++ = s[1] ^ 0x20;
+			s += 2;
+		} else if (esc) {
+			s++;
+		}
+	}
+
+	n = d - (uint8_t *)dst;
+
+	return n > 2 ? n - 2 : 0;
+}
+
+void hdlc_stats(FILE *fp)
+{
+	fprintf(fp, "hdlc: %lu bad frames, %lu oversized frames\n",
+		hdlc_bad_frames, hdlc_oversized_frames);
+}
@@ -32,22 +32,50 @@
 #ifndef __HDLC_H__
 #define __HDLC_H__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "circ_buf.h"
 
+#define HDLC_BUF_SIZE 16384
+
 struct circ_buf;
 
+/**
+ * struct hdlc_decoder - HDLC decoder context
+ * @raw_buf:	content of the current frame, decoded or as received
+ * @len:	number of bytes stored in @raw_buf
+ * @escape:	value to XOR the next byte with, after a 0x7d
+ * @msg_len:	length of the unescaped frame, in passthrough
+ * @fcs:	FCS over the unescaped frame so far, in passthrough
+ * @discard:	current frame exceeds @raw_buf and is being skipped
+ * @bad:	number of frames dropped for being short or failing the FCS
+ * @oversized:	number of frames dropped for exceeding @raw_buf
+ */
 struct hdlc_decoder {
 	char raw_buf[HDLC_BUF_SIZE];
-	char *raw;
+	size_t len;
 
 	uint8_t escape;
+	size_t msg_len;
+	uint16_t fcs;
+	bool discard;
+
+	unsigned long bad;
+	unsigned long oversized;
 };
 
-void *hdlc_encode(const void *src, size_t slen, size_t *dlen);
+size_t hdlc_encode_size(const void *src, size_t slen);
+size_t hdlc_encode(void *dst, const void *src, size_t slen);
 
 void *hdlc_decode_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
 		      size_t *msglen);
+void *hdlc_decode_buf(struct hdlc_decoder *hdlc, const void **data,
+		      size_t *count, size_t *msglen);
+void *hdlc_frame_one(struct hdlc_decoder *hdlc, struct circ_buf *buf,
+		     size_t *framelen);
+size_t hdlc_unframe(void *dst, const void *frame, size_t framelen);
+void hdlc_stats(FILE *fp);
 
 #endif
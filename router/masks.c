@@ -37,13 +37,45 @@
 #include "peripheral.h"
 #include "util.h"
 
-#define APPS_BUF_SIZE 16384
+#define MSG_MASK_SLOTS		(2 * MAX_SSID_PER_RANGE)
+#define EVENT_MASK_MAX		BITS_TO_BYTES(UINT16_MAX)
+#define SSID_INDEX_NONE		0xff
 
 struct diag_mask_info {
 	void *ptr;
 	int mask_len;
 	uint8_t status;
-}__packed;
+};
+
+/**
+ * struct diag_mask_arena - storage of all masks
+ * @msg:	message mask of each SSID range
+ * @build:	build time mask of each SSID range
+ * @log:	log mask of each equip ID, indexed by equip ID
+ * @msg_bits:	message mask bitmaps, sized for the largest range tools may set
+ * @build_bits:	build time mask bitmaps
+ * @log_bits:	log mask bitmaps, sized for the largest item count allowed
+ * @event_bits:	event mask bitmap, sized for the largest event id
+ * @ssid_index:	index in @msg and @build of the range an SSID may belong to
+ *
+ * All masks are carved out of a single allocation, sized up front for the
+ * largest masks the tools may configure, so that none of them has to be
+ * reallocated and looking a mask up is a matter of indexing.
+ */
+struct diag_mask_arena {
+	struct diag_msg_mask_t msg[MSG_MASK_TBL_CNT];
+	struct diag_msg_mask_t build[MSG_MASK_TBL_CNT];
+	struct diag_log_mask_t log[MAX_EQUIP_ID];
+
+	uint32_t msg_bits[MSG_MASK_TBL_CNT][MSG_MASK_SLOTS] __aligned(64);
+	uint32_t build_bits[MSG_MASK_TBL_CNT][MAX_SSID_PER_RANGE] __aligned(64);
+	uint8_t log_bits[MAX_EQUIP_ID][MAX_ITEMS_PER_EQUIP_ID] __aligned(64);
+	uint8_t event_bits[EVENT_MASK_MAX] __aligned(64);
+
+	uint8_t ssid_index[UINT16_MAX + 1] __aligned(64);
+};
+
+static struct diag_mask_arena *arena;
 
 static struct diag_mask_info msg_mask;
 static struct diag_mask_info msg_bt_mask;
@@ -52,31 +84,19 @@ static struct diag_mask_info event_mask;
 
 uint16_t event_max_num_bits;
 
-static int diag_mask_init(struct diag_mask_info *mask_info, int mask_len,
-			    int update_buf_len)
+static void diag_mask_init(struct diag_mask_info *mask_info, void *ptr,
+			   int mask_len)
 {
-	if (!mask_info || mask_len < 0 || update_buf_len < 0)
-		return -EINVAL;
-
 	mask_info->status = DIAG_CTRL_MASK_INVALID;
 	mask_info->mask_len = mask_len;
-	if (mask_len > 0) {
-		mask_info->ptr = malloc(mask_len);
-		if (!mask_info->ptr)
-			return -ENOMEM;
-		memset(mask_info->ptr, 0, mask_len);
-	}
-
-	return 0;
+	mask_info->ptr = ptr;
 }
 
 static int diag_create_msg_mask_table_entry(struct diag_msg_mask_t *msg_mask,
-				    uint32_t entry)
+					    uint32_t *bits, size_t slots,
+					    uint32_t entry)
 {
-	if (!msg_mask)
-		return -EIO;
-
-	if (entry > NUM_OF_MASK_RANGES)
+	if (entry >= NUM_OF_MASK_RANGES)
 		return -EINVAL;
 
 	msg_mask->ssid_first = ssid_first_arr[entry];
@@ -88,187 +108,146 @@ static int diag_create_msg_mask_table_entry(struct diag_msg_mask_t *msg_mask,
 		msg_mask->range = MAX_SSID_PER_RANGE;
 	msg_mask->range_tools = msg_mask->range;
 
-	if (msg_mask->range > 0) {
-		msg_mask->ptr = malloc(msg_mask->range * sizeof(uint32_t));
-		if (!msg_mask->ptr)
-			return -ENOMEM;
-		memset(msg_mask->ptr, 0xFF, msg_mask->range * sizeof(uint32_t));
-	}
+	if (msg_mask->range > slots)
+		return -EINVAL;
+
+	msg_mask->ptr = bits;
+	memset(bits, 0xFF, slots * sizeof(uint32_t));
 
 	return 0;
 }
 
-static int diag_create_build_time_mask()
+/*
+ * Map each SSID to the only range which may hold it: tools may extend a
+ * range up to MSG_MASK_SLOTS entries, but never into the next range.
+ */
+static void diag_create_ssid_index(void)
 {
-	int err = 0;
-	struct diag_msg_mask_t *build_mask = msg_bt_mask.ptr;
+	unsigned int first;
+	unsigned int last;
 	int i;
 
-	for (i = 0; i < MSG_MASK_TBL_CNT; i++, build_mask++) {
-		err = diag_create_msg_mask_table_entry(build_mask, i);
-		if (err)
-			break;
-	}
-
-	return err;
-}
+	memset(arena->ssid_index, SSID_INDEX_NONE, sizeof(arena->ssid_index));
 
-static int diag_create_msg_mask_table()
-{
-	int err = 0;
-	struct diag_msg_mask_t *mask = msg_mask.ptr;
-	int i;
+	for (i = 0; i < MSG_MASK_TBL_CNT; i++) {
+		first = ssid_first_arr[i];
+		last = MIN(first + MSG_MASK_SLOTS - 1, UINT16_MAX);
+		if (i < MSG_MASK_TBL_CNT - 1)
+			last = MIN(last, ssid_first_arr[i + 1] - 1);
 
-	for (i = 0; i < MSG_MASK_TBL_CNT; i++, mask++) {
-		err = diag_create_msg_mask_table_entry(mask, i);
-		if (err)
-			break;
+		memset(&arena->ssid_index[first], i, last - first + 1);
 	}
-
-	return err;
 }
 
-static int diag_msg_mask_init()
+static int diag_msg_mask_init(void)
 {
 	int ret;
-
-	ret = diag_mask_init(&msg_mask, MSG_MASK_SIZE, APPS_BUF_SIZE);
-	if (ret)
-		return ret;
-
-	ret = diag_create_msg_mask_table();
-	if (ret) {
-		printf("diag: Unable to create msg masks, err: %d\n", ret);
-		return ret;
-	}
-
-	return ret;
-}
-
-static void diag_msg_mask_exit()
-{
-	struct diag_msg_mask_t *mask = msg_mask.ptr;
 	int i;
 
-	if (mask) {
-		for (i = 0; i < MSG_MASK_TBL_CNT; i++, mask++)
-			free(mask->ptr);
-		free(msg_mask.ptr);
-	}
-}
-
-static int diag_build_time_mask_init()
-{
-	int err;
+	diag_mask_init(&msg_mask, arena->msg, sizeof(arena->msg));
+	diag_mask_init(&msg_bt_mask, arena->build, sizeof(arena->build));
 
-	/* There is no need for update buffer for Build Time masks */
-	err = diag_mask_init(&msg_bt_mask, MSG_MASK_SIZE, 0);
-	if (err)
-		return err;
+	for (i = 0; i < MSG_MASK_TBL_CNT; i++) {
+		ret = diag_create_msg_mask_table_entry(&arena->msg[i],
+						       arena->msg_bits[i],
+						       MSG_MASK_SLOTS, i);
+		if (ret) {
+			printf("diag: Unable to create msg masks, err: %d\n", ret);
+			return ret;
+		}
 
-	err = diag_create_build_time_mask();
-	if (err) {
-		printf("diag: Unable to create msg build time masks, err: %d\n", err);
-		return err;
+		ret = diag_create_msg_mask_table_entry(&arena->build[i],
+						       arena->build_bits[i],
+						       MAX_SSID_PER_RANGE, i);
+		if (ret) {
+			printf("diag: Unable to create msg build time masks, err: %d\n", ret);
+			return ret;
+		}
 	}
 
-	return 0;
-}
+	diag_create_ssid_index();
 
-static void diag_build_time_mask_exit(void)
-{
-	struct diag_msg_mask_t *mask = msg_bt_mask.ptr;
-	int i;
-
-	if (mask) {
-		for (i = 0; i < MSG_MASK_TBL_CNT; i++, mask++)
-			free(mask->ptr);
-		free(msg_bt_mask.ptr);
-	}
+	return 0;
 }
 
-static int diag_create_log_mask_table(void)
+static void diag_log_mask_init(void)
 {
-	struct diag_log_mask_t *mask = log_mask.ptr;
+	struct diag_log_mask_t *mask = arena->log;
 	uint8_t equip_id;
-	int err = 0;
+
+	diag_mask_init(&log_mask, arena->log, sizeof(arena->log));
 
 	for (equip_id = 0; equip_id < MAX_EQUIP_ID; equip_id++, mask++) {
 		mask->equip_id = equip_id;
 		mask->num_items = LOG_GET_ITEM_NUM(log_code_last_tbl[equip_id]);
 		mask->num_items_tools = mask->num_items;
-		if (BITS_TO_BYTES(mask->num_items) > MAX_ITEMS_PER_EQUIP_ID)
-			mask->range = BITS_TO_BYTES(mask->num_items);
-		else
-			mask->range = MAX_ITEMS_PER_EQUIP_ID;
+		mask->range = MAX_ITEMS_PER_EQUIP_ID;
 		mask->range_tools = mask->range;
-		mask->ptr = malloc(mask->range);
-		if (!mask->ptr) {
-			err = -ENOMEM;
-			break;
-		}
-		memset(mask->ptr, 0, mask->range);
+		mask->ptr = arena->log_bits[equip_id];
 	}
-
-	return err;
 }
 
-static int diag_log_mask_init(void)
+static void diag_event_mask_init(void)
 {
-	int ret;
-
-	ret = diag_mask_init(&log_mask, LOG_MASK_SIZE, APPS_BUF_SIZE);
-	if (ret)
-		return ret;
+	event_max_num_bits = APPS_EVENT_LAST_ID;
 
-	return diag_create_log_mask_table();
+	diag_mask_init(&event_mask, arena->event_bits, EVENT_MASK_SIZE);
 }
 
-static void diag_log_mask_exit(void)
+int diag_masks_init()
 {
-	struct diag_log_mask_t *mask = log_mask.ptr;
-	int i;
+	arena = aligned_alloc(64, sizeof(*arena));
+	if (!arena) {
+		printf("diag: Could not initialize diag mask buffers\n");
 
-	if (mask) {
-		for (i = 0; i < MAX_EQUIP_ID; i++, mask++)
-			free(mask->ptr);
-		free(log_mask.ptr);
+		return -ENOMEM;
 	}
-}
+	memset(arena, 0, sizeof(*arena));
 
-static int diag_event_mask_init(void)
-{
-	event_max_num_bits = APPS_EVENT_LAST_ID;
+	if (diag_msg_mask_init()) {
+		diag_masks_exit();
+
+		return -EINVAL;
+	}
 
-	return diag_mask_init(&event_mask, EVENT_MASK_SIZE, APPS_BUF_SIZE);
+	diag_log_mask_init();
+	diag_event_mask_init();
+
+	return 0;
 }
 
-static void diag_event_mask_exit(void)
+void diag_masks_exit()
 {
-	free(event_mask.ptr);
+	free(arena);
+	arena = NULL;
 }
 
-int diag_masks_init()
+/* Return the mask of the SSID range which may hold @ssid, or NULL */
+static struct diag_msg_mask_t *diag_msg_mask_find(struct diag_msg_mask_t *table,
+						  uint16_t ssid)
 {
-	if (diag_msg_mask_init() ||
-		diag_build_time_mask_init() ||
-		diag_log_mask_init() ||
-		diag_event_mask_init()) {
-		diag_masks_exit();
-		printf("diag: Could not initialize diag mask buffers\n");
+	uint8_t idx = arena->ssid_index[ssid];
 
-		return -ENOMEM;
-	}
+	if (idx == SSID_INDEX_NONE)
+		return NULL;
 
-	return 0;
+	return &table[idx];
 }
 
-void diag_masks_exit()
+/* Return the index of the SSID range which may hold @ssid, or -1 */
+int diag_msg_mask_index(uint16_t ssid)
 {
-	diag_msg_mask_exit();
-	diag_build_time_mask_exit();
-	diag_log_mask_exit();
-	diag_event_mask_exit();
+	uint8_t idx = arena->ssid_index[ssid];
+
+	return idx == SSID_INDEX_NONE ? -1 : idx;
+}
+
+static struct diag_log_mask_t *diag_log_mask_find(uint32_t equip_id)
+{
+	if (equip_id >= MAX_EQUIP_ID)
+		return NULL;
+
+	return &arena->log[equip_id];
 }
 
 uint8_t diag_get_log_mask_status()
@@ -297,16 +276,12 @@ void diag_cmd_get_log_range(uint32_t *ranges, uint32_t count)
 	}
 }
 
-int diag_cmd_set_log_mask(uint8_t equip_id, uint32_t *num_items, uint8_t *mask, uint32_t *mask_size)
+int diag_cmd_set_log_mask(uint32_t equip_id, uint32_t *num_items, const uint8_t *mask, uint32_t *mask_size)
 {
-	struct diag_log_mask_t *log_item = log_mask.ptr;
-	void *tmp_buf;
-	int i;
-
-	for (i = 0; i < MAX_EQUIP_ID; i++, log_item++) {
-		if (log_item->equip_id != equip_id)
-			continue;
+	struct diag_log_mask_t *log_item;
 
+	log_item = diag_log_mask_find(equip_id);
+	if (log_item) {
 #if 0
 		diag_dbg(DIAG_DBG_MASKS, "Found equip_id=%d\n"
 				"current num_items=%u range=%u\n"
@@ -316,22 +291,11 @@ int diag_cmd_set_log_mask(uint8_t equip_id, uint32_t *num_items, uint8_t *mask,
 				*num_items, BITS_TO_BYTES(*num_items));
 #endif
 
+		/* MAX_ITEMS_ALLOWED items always fit in the range of the mask */
 		log_item->num_items_tools = MIN(*num_items, MAX_ITEMS_ALLOWED);
 		*mask_size = BITS_TO_BYTES(log_item->num_items_tools);
 		memset(log_item->ptr, 0, log_item->range_tools);
 
-		if (*mask_size > log_item->range_tools) {
-			tmp_buf = realloc(log_item->ptr, *mask_size);
-			if (!tmp_buf) {
-				log_mask.status = DIAG_CTRL_MASK_INVALID;
-				warn("Failed to reallocate log mask\n");
-
-				return -errno;
-			}
-			log_item->ptr = tmp_buf;
-			memset(log_item->ptr, 0, *mask_size);
-			log_item->range_tools = *mask_size;
-		}
 		*num_items = log_item->num_items_tools;
 		memcpy(log_item->ptr, mask, *mask_size);
 		log_mask.status = DIAG_CTRL_MASK_VALID;
@@ -342,25 +306,19 @@ int diag_cmd_set_log_mask(uint8_t equip_id, uint32_t *num_items, uint8_t *mask,
 	return 1;
 }
 
-int diag_cmd_get_log_mask(uint32_t equip_id, uint32_t *num_items, uint8_t ** mask, uint32_t *mask_size)
+/*
+ * The mask getters below return views of the masks, valid until the masks
+ * are next updated.
+ */
+int diag_cmd_get_log_mask(uint32_t equip_id, uint32_t *num_items, const uint8_t **mask, uint32_t *mask_size)
 {
-	struct diag_log_mask_t *log_item = log_mask.ptr;
-	int i;
-
-	for (i = 0; i < MAX_EQUIP_ID; i++, log_item++) {
-		if (log_item->equip_id != equip_id) {
-			continue;
-		}
+	struct diag_log_mask_t *log_item;
 
+	log_item = diag_log_mask_find(equip_id);
+	if (log_item) {
 		*num_items = log_item->num_items_tools;
 		*mask_size = BITS_TO_BYTES(log_item->num_items_tools);
-		*mask = malloc(*mask_size);
-		if (!*mask) {
-			warn("Failed to allocate log mask\n");
-
-			return -errno;
-		}
-		memcpy(*mask, log_item->ptr, *mask_size);
+		*mask = log_item->ptr;
 
 		return 0;
 	}
@@ -368,24 +326,14 @@ int diag_cmd_get_log_mask(uint32_t equip_id, uint32_t *num_items, uint8_t ** mas
 	return 1;
 }
 
-void diag_cmd_get_ssid_range(uint32_t *count, struct diag_ssid_range_t **ranges)
+void diag_cmd_get_ssid_range(struct diag_ssid_range_t *ranges, uint32_t count)
 {
 	struct diag_msg_mask_t *msg_item = msg_mask.ptr;
-	struct diag_ssid_range_t *range;
 	int i;
 
-	*count = MSG_MASK_TBL_CNT;
-	*ranges = calloc(*count, sizeof(**ranges));
-	if (!*ranges) {
-		warn("Failed to allocate ssid ranges\n");
-
-		return;
-	}
-
-	range = *ranges;
-	for (i = 0; i < *count; i++, msg_item++, range++) {
-		range->ssid_first = msg_item->ssid_first;
-		range->ssid_last = msg_item->ssid_last_tools;
+	for (i = 0; i < MIN(MSG_MASK_TBL_CNT, count); i++, msg_item++, ranges++) {
+		ranges->ssid_first = msg_item->ssid_first;
+		ranges->ssid_last = msg_item->ssid_last_tools;
 	}
 }
 
@@ -394,32 +342,20 @@ uint8_t diag_get_build_mask_status()
 	return msg_bt_mask.status;
 }
 
-int diag_cmd_get_build_mask(struct diag_ssid_range_t *range, uint32_t **mask)
+int diag_cmd_get_build_mask(struct diag_ssid_range_t *range, const uint32_t **mask)
 {
-	struct diag_msg_mask_t *msg_item = msg_bt_mask.ptr;
+	struct diag_msg_mask_t *msg_item;
 	uint32_t num_entries = 0;
-	uint32_t mask_size = 0;
-	int i;
 
-	for (i = 0;i < MSG_MASK_TBL_CNT; i++, msg_item++) {
-		if (msg_item->ssid_first != range->ssid_first) {
-			continue;
-		}
+	msg_item = diag_msg_mask_find(msg_bt_mask.ptr, range->ssid_first);
+	if (msg_item && msg_item->ssid_first == range->ssid_first) {
 		num_entries = range->ssid_last - range->ssid_first + 1;
 		if (num_entries > msg_item->range) {
 			warn("diag: Truncating ssid range for ssid_first: %d ssid_last %d\n",
 				range->ssid_first, range->ssid_last);
-			num_entries = msg_item->range;
-			range->ssid_last = range->ssid_first + msg_item->range;
-		}
-		mask_size = num_entries * sizeof(uint32_t);
-		*mask = malloc(mask_size);
-		if (!*mask) {
-			warn("Failed to allocate build mask\n");
-
-			return -errno;
+			range->ssid_last = range->ssid_first + msg_item->range - 1;
 		}
-		memcpy(*mask, msg_item->ptr, mask_size);
+		*mask = msg_item->ptr;
 
 		return 0;
 	}
@@ -432,28 +368,15 @@ uint8_t diag_get_msg_mask_status()
 	return msg_mask.status;
 }
 
-int diag_cmd_get_msg_mask(struct diag_ssid_range_t *range, uint32_t **mask)
+int diag_cmd_get_msg_mask(struct diag_ssid_range_t *range, const uint32_t **mask)
 {
-	struct diag_msg_mask_t *msg_item = msg_mask.ptr;
-	uint32_t mask_size = 0;
-	int i;
+	struct diag_msg_mask_t *msg_item;
 
-	for (i = 0; i < MSG_MASK_TBL_CNT; i++, msg_item++) {
-		if ((range->ssid_first < msg_item->ssid_first) ||
-		    (range->ssid_first > msg_item->ssid_last_tools)) {
-			continue;
-		}
-
-		mask_size = msg_item->range * sizeof(**mask);
+	msg_item = diag_msg_mask_find(msg_mask.ptr, range->ssid_first);
+	if (msg_item && range->ssid_first <= msg_item->ssid_last_tools) {
 		range->ssid_first = msg_item->ssid_first;
 		range->ssid_last = msg_item->ssid_last;
-		*mask = malloc(mask_size);
-		if (!*mask) {
-			warn("Failed to allocate event mask\n");
-
-			return -errno;
-		}
-		memcpy(*mask, msg_item->ptr, mask_size);
+		*mask = msg_item->ptr;
 
 		return 0;
 	}
@@ -463,28 +386,13 @@ int diag_cmd_get_msg_mask(struct diag_ssid_range_t *range, uint32_t **mask)
 
 int diag_cmd_set_msg_mask(struct diag_ssid_range_t range, const uint32_t *mask)
 {
-	struct diag_msg_mask_t *msg_item = msg_mask.ptr;
+	struct diag_msg_mask_t *msg_item;
 	uint32_t num_msgs = 0;
-	struct diag_msg_mask_t *mask_next = NULL;
 	uint32_t offset = 0;
-	void *tmp_buf;
-	int i;
-
-	for (i = 0; i < MSG_MASK_TBL_CNT; i++, msg_item++) {
-		if (i < (MSG_MASK_TBL_CNT - 1)) {
-			mask_next = msg_item;
-			mask_next++;
-		} else{
-			mask_next = NULL;
-		}
-
-		if ((range.ssid_first < msg_item->ssid_first) ||
-			(range.ssid_first > msg_item->ssid_first + MAX_SSID_PER_RANGE) ||
-			(mask_next && (range.ssid_first >= mask_next->ssid_first))) {
-			continue;
-		}
 
-		mask_next = NULL;
+	msg_item = diag_msg_mask_find(msg_mask.ptr, range.ssid_first);
+	if (msg_item &&
+	    range.ssid_first <= msg_item->ssid_first + MAX_SSID_PER_RANGE) {
 		num_msgs = range.ssid_last - range.ssid_first + 1;
 		if (num_msgs > MAX_SSID_PER_RANGE) {
 			warn("diag: Truncating ssid range, %d-%d to max allowed: %d\n",
@@ -497,15 +405,8 @@ int diag_cmd_set_msg_mask(struct diag_ssid_range_t range, const uint32_t *mask)
 		if (range.ssid_last > msg_item->ssid_last_tools) {
 			if (num_msgs != MAX_SSID_PER_RANGE)
 				msg_item->ssid_last_tools = range.ssid_last;
+			/* Bounded by MSG_MASK_SLOTS, the size of the mask */
 			msg_item->range_tools = msg_item->ssid_last_tools - msg_item->ssid_first + 1;
-			tmp_buf = realloc(msg_item->ptr, msg_item->range_tools * sizeof(*mask));
-			if (!tmp_buf) {
-				msg_mask.status = DIAG_CTRL_MASK_INVALID;
-				warn("Failed to reallocate msg mask\n");
-
-				return -errno;
-			}
-			msg_item->ptr = tmp_buf;
 		}
 
 		offset = range.ssid_first - msg_item->ssid_first;
@@ -541,39 +442,20 @@ uint8_t diag_get_event_mask_status()
 	return event_mask.status;
 }
 
-int diag_cmd_get_event_mask(uint16_t num_bits, uint8_t **mask)
+int diag_cmd_get_event_mask(uint16_t num_bits, const uint8_t **mask)
 {
-	uint32_t mask_size = BITS_TO_BYTES(num_bits);
-
 	if (num_bits > event_max_num_bits) {
 		return 1;
 	}
 
-	*mask = malloc(mask_size);
-	if (!*mask) {
-		warn("Failed to allocate event mask\n");
-
-		return -errno;
-	}
-	memcpy(*mask, event_mask.ptr, mask_size);
+	*mask = event_mask.ptr;
 
 	return 0;
 }
 
 int diag_cmd_update_event_mask(uint16_t num_bits, const uint8_t *mask)
 {
-	void *tmp_buf;
-
 	if (num_bits > event_max_num_bits ) {
-		tmp_buf = realloc(event_mask.ptr, BITS_TO_BYTES(num_bits));
-		if (!tmp_buf) {
-			event_mask.status = DIAG_CTRL_MASK_INVALID;
-			warn("Failed to reallocate event mask\n");
-
-			return -errno;
-		}
-
-		event_mask.ptr = tmp_buf;
 		event_max_num_bits = num_bits;
 		event_mask.mask_len = BITS_TO_BYTES(num_bits);
 	}
@@ -36,6 +36,10 @@
 #define __packed __attribute__((__packed__))
 #endif
 
+#ifndef __aligned
+#define __aligned(x) __attribute__((__aligned__(x)))
+#endif
+
 #define MSG_MASKS_TYPE		0x00000001
 #define LOG_MASKS_TYPE		0x00000002
 #define EVENT_MASKS_TYPE	0x00000004
@@ -101,7 +105,7 @@ struct diag_log_mask_t {
 	uint32_t range;
 	uint32_t range_tools;
 	uint8_t *ptr;
-}__packed;
+};
 
 struct diag_ssid_range_t {
 	uint16_t ssid_first;
@@ -115,10 +119,7 @@ struct diag_msg_mask_t {
 	uint32_t range;
 	uint32_t range_tools;
 	uint32_t *ptr;
-}__packed;
-
-#define MSG_MASK_SIZE	(MSG_MASK_TBL_CNT * sizeof(struct diag_msg_mask_t))
-#define LOG_MASK_SIZE	(MAX_EQUIP_ID * sizeof(struct diag_log_mask_t))
+};
 
 int diag_masks_init(void);
 void diag_masks_exit(void);
@@ -126,20 +127,21 @@ void diag_masks_exit(void);
 uint8_t diag_get_log_mask_status();
 void diag_cmd_disable_log();
 void diag_cmd_get_log_range(uint32_t *ranges, uint32_t count);
-int diag_cmd_set_log_mask(uint8_t equip_id, uint32_t *num_items, uint8_t *mask, uint32_t *mask_size);
-int diag_cmd_get_log_mask(uint32_t equip_id, uint32_t *num_items, uint8_t ** mask, uint32_t *mask_size);
+int diag_cmd_set_log_mask(uint32_t equip_id, uint32_t *num_items, const uint8_t *mask, uint32_t *mask_size);
+int diag_cmd_get_log_mask(uint32_t equip_id, uint32_t *num_items, const uint8_t **mask, uint32_t *mask_size);
 
 uint8_t diag_get_build_mask_status();
-void diag_cmd_get_ssid_range(uint32_t *count, struct diag_ssid_range_t **ranges);
-int diag_cmd_get_build_mask(struct diag_ssid_range_t *range, uint32_t **mask);
+void diag_cmd_get_ssid_range(struct diag_ssid_range_t *ranges, uint32_t count);
+int diag_cmd_get_build_mask(struct diag_ssid_range_t *range, const uint32_t **mask);
 
 uint8_t diag_get_msg_mask_status();
-int diag_cmd_get_msg_mask(struct diag_ssid_range_t *range, uint32_t **mask);
+int diag_msg_mask_index(uint16_t ssid);
+int diag_cmd_get_msg_mask(struct diag_ssid_range_t *range, const uint32_t **mask);
 int diag_cmd_set_msg_mask(struct diag_ssid_range_t range, const uint32_t *mask);
 void diag_cmd_set_all_msg_mask(uint32_t mask);
 
 uint8_t diag_get_event_mask_status();
-int diag_cmd_get_event_mask(uint16_t num_bits, uint8_t **mask);
+int diag_cmd_get_event_mask(uint16_t num_bits, const uint8_t **mask);
 int diag_cmd_update_event_mask(uint16_t num_bits, const uint8_t *mask);
 void diag_cmd_toggle_events(bool enabled);
 
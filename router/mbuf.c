@@ -28,33 +28,335 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mbuf.h"
+#include "util.h"
 
-struct mbuf *mbuf_alloc(size_t size)
+/**
+ * struct mbuf_pool - free list of mbufs of one size class
+ * @size:	data capacity of the mbufs in the pool
+ * @free:	list of mbufs available for reuse
+ * @allocated:	number of mbufs allocated for the pool
+ * @in_use:	number of mbufs currently handed out
+ * @high_water:	highest value of @in_use seen
+ * @hits:	allocations satisfied from @free
+ * @misses:	allocations which had to fall back to malloc()
+ */
+struct mbuf_pool {
+	size_t size;
+	struct list_head free;
+
+	unsigned int allocated;
+	unsigned int in_use;
+	unsigned int high_water;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+#define MBUF_POOL(sz, i) { .size = sz, .free = LIST_INIT(mbuf_pools[i].free) }
+
+/*
+ * Size classes cover the data-less headers of cloned mbufs, the short command
+ * responses, typical log and message packets and the 16kB USB transfer
+ * buffers; anything larger is allocated and freed directly.
+ */
+static struct mbuf_pool mbuf_pools[] = {
+	MBUF_POOL(0, 0),
+	MBUF_POOL(64, 1),
+	MBUF_POOL(256, 2),
+	MBUF_POOL(1024, 3),
+	MBUF_POOL(4096, 4),
+	MBUF_POOL(16384, 5),
+};
+
+static struct mbuf_pool *mbuf_pool_find(size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mbuf_pools); i++) {
+		if (size <= mbuf_pools[i].size)
+			return &mbuf_pools[i];
+	}
+
+	return NULL;
+}
+
+static struct mbuf *mbuf_pool_grow(struct mbuf_pool *pool)
 {
 	struct mbuf *mbuf;
 
-	mbuf = malloc(sizeof(*mbuf) + size);
+	mbuf = malloc(sizeof(*mbuf) + pool->size);
 	if (!mbuf)
 		return NULL;
 
+	pool->allocated++;
+
+	return mbuf;
+}
+
+/**
+ * mbuf_alloc_room() - allocate an mbuf with room for framing
+ * @headroom:	space to reserve ahead of the data, for mbuf_push()
+ * @size:	size of the data
+ * @tailroom:	space to reserve following the data, for mbuf_put()
+ *
+ * Return: the new mbuf, or NULL on allocation failure
+ */
+struct mbuf *mbuf_alloc_room(size_t headroom, size_t size, size_t tailroom)
+{
+	size_t capacity = headroom + size + tailroom;
+	struct mbuf_pool *pool;
+	struct mbuf *mbuf;
+
+	pool = mbuf_pool_find(capacity);
+	if (!pool) {
+		mbuf = malloc(sizeof(*mbuf) + capacity);
+	} else if (!list_empty(&pool->free)) {
+		mbuf = list_entry_first(&pool->free, struct mbuf, node);
+		list_del(&mbuf->node);
+		pool->hits++;
+	} else {
+		mbuf = mbuf_pool_grow(pool);
+		pool->misses++;
+	}
+
+	if (!mbuf)
+		return NULL;
+
+	if (pool) {
+		pool->in_use++;
+		pool->high_water = MAX(pool->high_water, pool->in_use);
+	}
+
 	memset(mbuf, 0, sizeof(*mbuf));
 	mbuf->size = size;
+	mbuf->capacity = pool ? pool->size : capacity;
+	mbuf->pool = pool;
+	mbuf->refcount = 1;
+	mbuf->data = mbuf->buf + headroom;
 
 	return mbuf;
 }
 
+struct mbuf *mbuf_alloc(size_t size)
+{
+	return mbuf_alloc_room(0, size, 0);
+}
+
+/**
+ * mbuf_clone() - create a new reference to the payload of an mbuf
+ * @mbuf:	mbuf to clone
+ *
+ * The returned mbuf has its own list node and flow context, so that the
+ * same payload can be queued to multiple clients, but shares the data of
+ * @mbuf, which therefore must not be modified while clones exist.
+ *
+ * Return: the new mbuf, or NULL on allocation failure
+ */
+struct mbuf *mbuf_clone(struct mbuf *mbuf)
+{
+	struct mbuf *shared = mbuf->shared ? mbuf->shared : mbuf;
+	struct mbuf *clone;
+
+	clone = mbuf_alloc(0);
+	if (!clone)
+		return NULL;
+
+	clone->size = mbuf->size;
+	clone->offset = mbuf->offset;
+	clone->capacity = mbuf->capacity;
+	clone->data = mbuf->data;
+	clone->shared = shared;
+	shared->refcount++;
+
+	return clone;
+}
+
+static void mbuf_release(struct mbuf *mbuf)
+{
+	struct mbuf_pool *pool = mbuf->pool;
+
+	if (!pool) {
+		free(mbuf);
+		return;
+	}
+
+	pool->in_use--;
+	list_add(&pool->free, &mbuf->node);
+}
+
+/**
+ * mbuf_free() - release an mbuf
+ * @mbuf:	mbuf to release, must not be on any list
+ *
+ * Pooled mbufs are returned to the free list of their size class. The
+ * payload of a cloned mbuf is released with its last reference.
+ */
+void mbuf_free(struct mbuf *mbuf)
+{
+	struct mbuf_account *account = mbuf->account;
+	struct mbuf *shared = mbuf->shared;
+
+	if (account) {
+		account->bytes -= mbuf->size;
+		account->packets--;
+	}
+
+	if (shared) {
+		mbuf_release(mbuf);
+		mbuf = shared;
+	}
+
+	if (--mbuf->refcount)
+		return;
+
+	mbuf_release(mbuf);
+}
+
+/**
+ * mbuf_charge() - charge an mbuf to the occupancy of a queue
+ * @mbuf:	mbuf being queued, with its final size
+ * @account:	occupancy of the queue
+ *
+ * The charge is returned as the mbuf is released, by whoever consumes it.
+ */
+void mbuf_charge(struct mbuf *mbuf, struct mbuf_account *account)
+{
+	mbuf->account = account;
+
+	account->bytes += mbuf->size;
+	account->packets++;
+}
+
+/**
+ * mbuf_pool_prealloc() - populate the mbuf pools ahead of time
+ * @count:	number of free mbufs to ensure in each size class
+ *
+ * Return: 0 on success, -ENOMEM if an allocation failed
+ */
+int mbuf_pool_prealloc(unsigned int count)
+{
+	struct mbuf_pool *pool;
+	struct mbuf *mbuf;
+	unsigned int n;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mbuf_pools); i++) {
+		pool = &mbuf_pools[i];
+
+		for (n = pool->allocated - pool->in_use; n < count; n++) {
+			mbuf = mbuf_pool_grow(pool);
+			if (!mbuf)
+				return -ENOMEM;
+
+			list_add(&pool->free, &mbuf->node);
+		}
+	}
+
+	return 0;
+}
+
+void mbuf_pool_stats(FILE *fp)
+{
+	struct mbuf_pool *pool;
+	size_t i;
+
+	fprintf(fp, "%8s %10s %8s %10s %12s %12s\n",
+		"size", "allocated", "in use", "high water", "hits", "misses");
+
+	for (i = 0; i < ARRAY_SIZE(mbuf_pools); i++) {
+		pool = &mbuf_pools[i];
+
+		fprintf(fp, "%8zu %10u %8u %10u %12lu %12lu\n",
+			pool->size, pool->allocated, pool->in_use,
+			pool->high_water, pool->hits, pool->misses);
+	}
+}
+
+static bool mbuf_writable(struct mbuf *mbuf)
+{
+	return !mbuf->shared && mbuf->refcount == 1;
+}
+
+/**
+ * mbuf_put() - fill data at the end of an mbuf
+ * @mbuf:	mbuf to fill
+ * @size:	number of bytes to fill
+ *
+ * The data is extended into the tailroom if it's already filled up.
+ *
+ * Return: pointer to the region to fill, or NULL if there's not enough room
+ */
 void *mbuf_put(struct mbuf *mbuf, size_t size)
 {
 	void *ptr;
 
-	if (mbuf->offset + size > mbuf->size)
-		return NULL;
+	if (mbuf->offset + size > mbuf->size) {
+		if (!mbuf_writable(mbuf) ||
+		    mbuf->offset + size > mbuf->size + mbuf_tailroom(mbuf))
+			return NULL;
+
+		mbuf->size = mbuf->offset + size;
+	}
 
 	ptr = mbuf->data + mbuf->offset;
 	mbuf->offset += size;
 
 	return ptr;
 }
+
+/**
+ * mbuf_push() - prepend data to an mbuf, using its headroom
+ * @mbuf:	mbuf to prepend to
+ * @size:	number of bytes to prepend
+ *
+ * Return: pointer to the new start of the data, or NULL if there's not
+ * enough headroom
+ */
+void *mbuf_push(struct mbuf *mbuf, size_t size)
+{
+	if (!mbuf_writable(mbuf) || size > mbuf_headroom(mbuf))
+		return NULL;
+
+	mbuf->data -= size;
+	mbuf->size += size;
+	mbuf->offset += size;
+
+	return mbuf->data;
+}
+
+/**
+ * mbuf_pull() - strip data from the start of an mbuf, into its headroom
+ * @mbuf:	mbuf to strip
+ * @size:	number of bytes to strip
+ *
+ * Return: pointer to the new start of the data, or NULL if @size exceeds
+ * the data
+ */
+void *mbuf_pull(struct mbuf *mbuf, size_t size)
+{
+	if (size > mbuf->size)
+		return NULL;
+
+	mbuf->data += size;
+	mbuf->size -= size;
+	mbuf->offset = mbuf->offset > size ? mbuf->offset - size : 0;
+
+	return mbuf->data;
+}
+
+/**
+ * mbuf_trim() - strip data from the end of an mbuf, into its tailroom
+ * @mbuf:	mbuf to trim
+ * @size:	new size of the data
+ */
+void mbuf_trim(struct mbuf *mbuf, size_t size)
+{
+	if (size >= mbuf->size)
+		return;
+
+	mbuf->size = size;
+	mbuf->offset = MIN(mbuf->offset, size);
+}
@@ -31,22 +31,80 @@
 #ifndef __MBUF_H__
 #define __MBUF_H__
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "list.h"
 
+struct mbuf_pool;
 struct watch_flow;
 
+/**
+ * struct mbuf_account - occupancy of a queue of mbufs
+ * @bytes:	size of the mbufs charged to the queue and not yet released
+ * @packets:	number of mbufs charged to the queue and not yet released
+ */
+struct mbuf_account {
+	size_t bytes;
+	unsigned int packets;
+};
+
+/**
+ * struct mbuf - message buffer
+ * @node:	entry in the queue holding the mbuf
+ * @size:	size of @data
+ * @offset:	amount of @data filled in
+ * @capacity:	size of @buf, covering headroom, @data and tailroom
+ * @flow:	flow control context accounting for the mbuf
+ * @account:	queue occupancy the mbuf is charged to, until released
+ * @pool:	pool the mbuf was allocated from, NULL if allocated directly
+ * @shared:	mbuf owning @data, for clones made by mbuf_clone()
+ * @refcount:	number of references to @buf, from the mbuf and its clones
+ * @data:	payload, pointing to @buf or into the @buf of @shared
+ * @buf:	storage backing @data
+ */
 struct mbuf {
 	struct list_head node;
 
 	size_t size;
 	size_t offset;
+	size_t capacity;
 
 	struct watch_flow *flow;
+	struct mbuf_account *account;
+	struct mbuf_pool *pool;
+
+	struct mbuf *shared;
+	unsigned int refcount;
 
-	char data[];
+	char *data;
+	char buf[];
 };
 
 struct mbuf *mbuf_alloc(size_t size);
+struct mbuf *mbuf_alloc_room(size_t headroom, size_t size, size_t tailroom);
+struct mbuf *mbuf_clone(struct mbuf *mbuf);
+void mbuf_free(struct mbuf *mbuf);
+void mbuf_charge(struct mbuf *mbuf, struct mbuf_account *account);
+
 void *mbuf_put(struct mbuf *mbuf, size_t size);
+void *mbuf_push(struct mbuf *mbuf, size_t size);
+void *mbuf_pull(struct mbuf *mbuf, size_t size);
+void mbuf_trim(struct mbuf *mbuf, size_t size);
+
+static inline size_t mbuf_headroom(struct mbuf *mbuf)
+{
+	struct mbuf *owner = mbuf->shared ? mbuf->shared : mbuf;
+
+	return mbuf->data - owner->buf;
+}
+
+static inline size_t mbuf_tailroom(struct mbuf *mbuf)
+{
+	return mbuf->capacity - mbuf_headroom(mbuf) - mbuf->size;
+}
+
+int mbuf_pool_prealloc(unsigned int count);
+void mbuf_pool_stats(FILE *fp);
 
 #endif
@@ -41,6 +41,7 @@
 #include "diag.h"
 #include "diag_cntl.h"
 #include "dm.h"
+#include "mbuf.h"
 #include "peripheral-qrtr.h"
 #include "watch.h"
 #include "util.h"
@@ -125,23 +126,29 @@ static int qrtr_cmd_recv(int fd, void *data)
 	struct sockaddr_qrtr cmdsq;
 	struct sockaddr_qrtr sq;
 	struct qrtr_packet pkt;
-	struct circ_buf *buf = &perif->recv_buf;
         socklen_t sl;
+	struct mbuf *mbuf;
 	ssize_t n;
 	int ret;
 
+	mbuf = mbuf_alloc(16384);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
 	sl = sizeof(sq);
-	n = recvfrom(fd, buf->buf, sizeof(buf->buf), 0, (void *)&sq, &sl);
+	n = recvfrom(fd, mbuf->data, mbuf->size, 0, (void *)&sq, &sl);
 	if (n < 0) {
 		ret = -errno;
 		if (ret != -ENETRESET)
 			fprintf(stderr, "[DIAG-QRTR] recvfrom failed: %d\n", ret);
+		mbuf_free(mbuf);
 		return ret;
 	}
 
-	ret = qrtr_decode(&pkt, buf->buf, n, &sq);
+	ret = qrtr_decode(&pkt, mbuf->data, n, &sq);
 	if (ret < 0) {
 		fprintf(stderr, "[PD-MAPPER] unable to decode qrtr packet\n");
+		mbuf_free(mbuf);
 		return ret;
 	}
 
@@ -165,7 +172,12 @@ static int qrtr_cmd_recv(int fd, void *data)
 			break;
 		}
 
-		dm_broadcast(frame->payload, frame->length, NULL);
+		/* Strip the QRTR and non-HDLC framing in place */
+		mbuf_trim(mbuf, frame->payload + frame->length - mbuf->data);
+		mbuf_pull(mbuf, frame->payload - mbuf->data);
+
+		diag_cmd_response(perif, mbuf);
+		mbuf = NULL;
 		break;
 	case QRTR_TYPE_NEW_SERVER:
 		if (pkt.node == 0 && pkt.port == 0)
@@ -190,6 +202,9 @@ static int qrtr_cmd_recv(int fd, void *data)
 		break;
 	}
 
+	if (mbuf)
+		mbuf_free(mbuf);
+
 	return 0;
 }
 
@@ -199,23 +214,29 @@ static int qrtr_data_recv(int fd, void *data)
 	struct sockaddr_qrtr sq;
 	struct qrtr_packet pkt;
         socklen_t sl;
-	uint8_t buf[4096];
+	struct mbuf *mbuf;
 	ssize_t n;
 	int ret;
 	struct non_hdlc_pkt *frame;
 
+	mbuf = mbuf_alloc(4096);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
 	sl = sizeof(sq);
-	n = recvfrom(fd, buf, sizeof(buf), 0, (void *)&sq, &sl);
+	n = recvfrom(fd, mbuf->data, mbuf->size, 0, (void *)&sq, &sl);
 	if (n < 0) {
 		ret = -errno;
 		if (ret != -ENETRESET)
 			fprintf(stderr, "[DIAG-QRTR] recvfrom failed: %d\n", ret);
+		mbuf_free(mbuf);
 		return ret;
 	}
 
-	ret = qrtr_decode(&pkt, buf, n, &sq);
+	ret = qrtr_decode(&pkt, mbuf->data, n, &sq);
 	if (ret < 0) {
 		fprintf(stderr, "[PD-MAPPER] unable to decode qrtr packet\n");
+		mbuf_free(mbuf);
 		return ret;
 	}
 
@@ -243,7 +264,13 @@ static int qrtr_data_recv(int fd, void *data)
 			fprintf(stderr, "non-HDLC frame is not truncated\n");
 			break;
 		}
-		dm_broadcast(frame->payload, frame->length, perif->flow);
+
+		/* Strip the QRTR and non-HDLC framing in place */
+		mbuf_trim(mbuf, frame->payload + frame->length - mbuf->data);
+		mbuf_pull(mbuf, frame->payload - mbuf->data);
+
+		dm_broadcast_mbuf(mbuf, perif->flow);
+		mbuf = NULL;
 		break;
 	case QRTR_TYPE_BYE:
 		watch_remove_writeq(perif->data_fd);
@@ -255,6 +282,9 @@ static int qrtr_data_recv(int fd, void *data)
 		break;
 	}
 
+	if (mbuf)
+		mbuf_free(mbuf);
+
 	return 0;
 }
 
@@ -279,7 +309,7 @@ static int qrtr_perif_init_subsystem(const char *name, int instance_base)
 
 	perif = calloc(1, sizeof(*perif));
 
-	flow = watch_flow_new();
+	flow = peripheral_flow_new(name);
 
 	perif->name = strdup(name);
 	perif->send = qrtr_perif_send;
@@ -50,12 +50,15 @@
 #include "dm.h"
 #include "hdlc.h"
 #include "list.h"
+#include "mbuf.h"
 #include "peripheral.h"
 #include "util.h"
 #include "watch.h"
 
 #define APPS_BUF_SIZE 16384
 
+#define PERIPHERAL_RECV_BUF_SIZE	(16 * 1024)
+
 struct devnode {
 	char *devnode;
 	char *name;
@@ -77,43 +80,61 @@ static int diag_cmd_recv(int fd, void *data)
 {
 	struct peripheral *peripheral = data;
 	struct non_hdlc_pkt *frame;
-	uint8_t buf[APPS_BUF_SIZE];
+	struct mbuf *mbuf;
 	ssize_t len;
 
-	len = read(fd, buf, sizeof(buf));
+	mbuf = mbuf_alloc(APPS_BUF_SIZE);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
+	len = read(fd, mbuf->data, mbuf->size);
 	if (len < 0) {
 		if (errno != EAGAIN) {
 			warn("failed to read from cmd channel");
 			peripheral_close(peripheral);
 		}
+		goto free_mbuf;
 	}
 
-	frame = (struct non_hdlc_pkt *)buf;
+	frame = (struct non_hdlc_pkt *)mbuf->data;
 	if (frame->start != 0x7e || frame->version != 1) {
 		fprintf(stderr, "invalid non-HDLC frame\n");
-		return 0;
+		goto free_mbuf;
 	}
 
 	if (sizeof(*frame) + frame->length + 1 > len) {
 		fprintf(stderr, "truncated non-HDLC frame\n");
-		return 0;
+		goto free_mbuf;
 	}
 
 	if (frame->payload[frame->length] != 0x7e) {
 		fprintf(stderr, "non-HDLC frame is not truncated\n");
-		return 0;
+		goto free_mbuf;
 	}
 
-	dm_broadcast(frame->payload, frame->length, NULL);
+	/* Strip the non-HDLC framing in place */
+	mbuf_trim(mbuf, sizeof(*frame) + frame->length);
+	mbuf_pull(mbuf, sizeof(*frame));
+
+	diag_cmd_response(peripheral, mbuf);
+
+	return 0;
+
+free_mbuf:
+	mbuf_free(mbuf);
 
 	return 0;
 }
 
+/*
+ * HDLC frames from the peripheral are validated and passed through as is,
+ * saving HDLC clients a decode and re-encode of every message.
+ */
 static int diag_data_recv_hdlc(int fd, struct peripheral *peripheral)
 {
-	size_t msglen;
+	size_t framelen;
 	ssize_t n;
-	void *msg;
+	void *frame;
 
 	for (;;) {
 		n = circ_read(fd, &peripheral->recv_buf);
@@ -121,13 +142,13 @@ static int diag_data_recv_hdlc(int fd, struct peripheral *peripheral)
 			return -errno;
 
 		for (;;) {
-			msg = hdlc_decode_one(&peripheral->recv_decoder,
-					      &peripheral->recv_buf,
-					      &msglen);
-			if (!msg)
+			frame = hdlc_frame_one(&peripheral->recv_decoder,
+					       &peripheral->recv_buf,
+					       &framelen);
+			if (!frame)
 				break;
 
-			dm_broadcast(msg, msglen, peripheral->flow);
+			dm_broadcast_hdlc(frame, framelen, peripheral->flow);
 		}
 	}
 
@@ -136,15 +157,24 @@ static int diag_data_recv_hdlc(int fd, struct peripheral *peripheral)
 
 static int diag_data_recv_raw(int fd, struct peripheral *peripheral)
 {
-	uint8_t buf[4096];
+	struct mbuf *mbuf;
 	ssize_t n;
+	int ret;
 
 	for (;;) {
-		n = read(fd, buf, sizeof(buf));
-		if (n < 0)
-			return -errno;
+		mbuf = mbuf_alloc(4096);
+		if (!mbuf)
+			err(1, "failed to allocate mbuf");
+
+		n = read(fd, mbuf->data, mbuf->size);
+		if (n < 0) {
+			ret = -errno;
+			mbuf_free(mbuf);
+			return ret;
+		}
 
-		dm_broadcast(buf, n, peripheral->flow);
+		mbuf_trim(mbuf, n);
+		dm_broadcast_mbuf(mbuf, peripheral->flow);
 	}
 
 	/* Not reached */
@@ -349,6 +379,8 @@ static void perif_rpmsg_close(struct peripheral *peripheral)
 	close(peripheral->cmd_fd);
 
 	list_del(&peripheral->node);
+	diag_cmd_forget(peripheral);
+	circ_free(&peripheral->recv_buf);
 	free(peripheral->name);
 	free(peripheral);
 }
@@ -372,7 +404,10 @@ static int peripheral_create(const char *rproc, const char *channel)
 	peripheral = malloc(sizeof(*peripheral));
 	memset(peripheral, 0, sizeof(*peripheral));
 
-	flow = watch_flow_new();
+	flow = peripheral_flow_new(rproc);
+
+	if (circ_init(&peripheral->recv_buf, PERIPHERAL_RECV_BUF_SIZE) < 0)
+		err(1, "failed to allocate peripheral receive buffer");
 
 	peripheral->name = strdup(rproc);
 	peripheral->data_fd = -1;
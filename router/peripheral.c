@@ -51,6 +51,88 @@
 
 struct list_head peripherals = LIST_INIT(peripherals);
 
+/**
+ * struct peripheral_limits - flow control watermarks of a peripheral
+ * @name:	name of the peripheral
+ * @high:	bytes outstanding above which the peripheral isn't read
+ * @low:	bytes outstanding at which reading resumes
+ * @node:	entry in the peripheral_limits list
+ */
+struct peripheral_limits {
+	char *name;
+	size_t high;
+	size_t low;
+
+	struct list_head node;
+};
+
+static struct list_head peripheral_limits = LIST_INIT(peripheral_limits);
+
+/**
+ * peripheral_set_flow_limits() - configure flow control of a peripheral
+ * @name:	name of the peripheral
+ * @high:	bytes outstanding above which the peripheral isn't read
+ * @low:	bytes outstanding at which reading resumes
+ *
+ * Applies to peripherals showing up after the call.
+ *
+ * Return: 0 on success, -EINVAL if @low exceeds @high
+ */
+int peripheral_set_flow_limits(const char *name, size_t high, size_t low)
+{
+	struct peripheral_limits *limits;
+
+	if (low > high)
+		return -EINVAL;
+
+	limits = calloc(1, sizeof(*limits));
+	if (!limits)
+		err(1, "failed to allocate peripheral limits");
+
+	limits->name = strdup(name);
+	limits->high = high;
+	limits->low = low;
+
+	list_add(&peripheral_limits, &limits->node);
+
+	return 0;
+}
+
+/**
+ * peripheral_flow_new() - create the flow control context of a peripheral
+ * @name:	name of the peripheral
+ *
+ * Return: flow control context, with the watermarks configured for @name
+ */
+struct watch_flow *peripheral_flow_new(const char *name)
+{
+	struct peripheral_limits *limits;
+	struct watch_flow *flow;
+
+	flow = watch_flow_new();
+	if (!flow)
+		err(1, "failed to allocate flow control context");
+
+	list_for_each_entry(limits, &peripheral_limits, node) {
+		if (!strcmp(limits->name, name))
+			watch_flow_set_watermarks(flow, limits->high,
+						  limits->low);
+	}
+
+	return flow;
+}
+
+void peripheral_stats(FILE *fp)
+{
+	struct peripheral *peripheral;
+
+	fprintf(fp, "%-16s %10s %10s %10s %8s %12s\n",
+		"peripheral", "queued", "high", "low", "blocked", "blocked ms");
+
+	list_for_each_entry(peripheral, &peripherals, node)
+		watch_flow_stats(peripheral->flow, fp, peripheral->name);
+}
+
 int peripheral_send(struct peripheral *peripheral, const void *ptr, size_t len)
 {
 	return peripheral->send(peripheral, ptr, len);
@@ -101,6 +183,21 @@ void peripheral_broadcast_msg_mask(struct diag_ssid_range_t *range)
 	list_for_each(item, &peripherals) {
 		peripheral = container_of(item, struct peripheral, node);
 
-		diag_cntl_send_msg_mask(peripheral, range);
+		if (range)
+			diag_cntl_send_msg_mask(peripheral, range);
+		else
+			diag_cntl_send_masks(peripheral);
+	}
+}
+
+void peripheral_broadcast_preset(unsigned int id)
+{
+	struct peripheral *peripheral;
+	struct list_head *item;
+
+	list_for_each(item, &peripherals) {
+		peripheral = container_of(item, struct peripheral, node);
+
+		diag_cntl_set_preset(peripheral, id);
 	}
 }
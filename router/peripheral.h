@@ -31,7 +31,10 @@
 #ifndef __PERIPHERAL_H__
 #define __PERIPHERAL_H__
 
+#include <stdio.h>
+
 struct diag_ssid_range_t;
+struct watch_flow;
 
 int peripheral_init(void);
 void peripheral_close(struct peripheral *peripheral);
@@ -39,6 +42,11 @@ void peripheral_close(struct peripheral *peripheral);
 void peripheral_broadcast_event_mask(void);
 void peripheral_broadcast_log_mask(unsigned int equip_id);
 void peripheral_broadcast_msg_mask(struct diag_ssid_range_t *range);
+void peripheral_broadcast_preset(unsigned int id);
+
+int peripheral_set_flow_limits(const char *name, size_t high, size_t low);
+struct watch_flow *peripheral_flow_new(const char *name);
+void peripheral_stats(FILE *fp);
 
 int peripheral_send(struct peripheral *peripheral, const void *ptr, size_t len);
 
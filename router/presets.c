@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "masks.h"
+#include "presets.h"
+#include "util.h"
+
+static const char *preset_map;
+static size_t preset_map_len;
+static const struct diag_preset_desc *preset_descs;
+static unsigned int preset_count;
+static unsigned int preset_active;
+
+static bool diag_preset_rec_valid(const struct diag_preset_rec *rec)
+{
+	switch (rec->type) {
+	case DIAG_PRESET_REC_MSG:
+		return rec->num_items &&
+		       rec->num_items <= MAX_SSID_PER_RANGE &&
+		       rec->num_items <= UINT16_MAX + 1 - rec->id &&
+		       rec->len == rec->num_items * sizeof(uint32_t);
+	case DIAG_PRESET_REC_LOG:
+		return rec->id < MAX_EQUIP_ID &&
+		       rec->num_items <= MAX_ITEMS_ALLOWED &&
+		       rec->len == BITS_TO_BYTES(rec->num_items);
+	case DIAG_PRESET_REC_EVENT:
+		return rec->num_items <= UINT16_MAX &&
+		       rec->len == BITS_TO_BYTES(rec->num_items);
+	default:
+		return false;
+	}
+}
+
+/* Check that the records of a preset exactly fill its extent */
+static bool diag_preset_valid(const char *map, size_t map_len,
+			     const struct diag_preset_desc *desc)
+{
+	const struct diag_preset_rec *rec;
+	size_t offset = desc->offset;
+	size_t end = offset + desc->len;
+
+	if (desc->offset > map_len || desc->len > map_len - desc->offset)
+		return false;
+
+	while (offset < end) {
+		if (end - offset < sizeof(*rec))
+			return false;
+
+		rec = (const struct diag_preset_rec *)(map + offset);
+		offset += sizeof(*rec);
+		if (rec->len > end - offset || !diag_preset_rec_valid(rec))
+			return false;
+
+		offset += rec->len;
+	}
+
+	return true;
+}
+
+/**
+ * diag_presets_load() - map the mask presets file
+ * @path:	path of the presets file
+ *
+ * The file is validated up front, and then used in place for the lifetime
+ * of the process.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int diag_presets_load(const char *path)
+{
+	const struct diag_preset_file_hdr *hdr;
+	const struct diag_preset_desc *descs;
+	struct stat st;
+	size_t descs_len;
+	char *map;
+	unsigned int i;
+	int ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = fstat(fd, &st);
+	if (ret < 0 || st.st_size < sizeof(*hdr)) {
+		ret = ret < 0 ? -errno : -EINVAL;
+		close(fd);
+		return ret;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	hdr = (const struct diag_preset_file_hdr *)map;
+	if (memcmp(hdr->magic, DIAG_PRESET_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != DIAG_PRESET_VERSION)
+		goto err_unmap;
+
+	descs_len = (size_t)hdr->count * sizeof(*descs);
+	if (!hdr->count || descs_len > st.st_size - sizeof(*hdr))
+		goto err_unmap;
+
+	descs = (const struct diag_preset_desc *)(map + sizeof(*hdr));
+	for (i = 0; i < hdr->count; i++) {
+		if (!diag_preset_valid(map, st.st_size, &descs[i])) {
+			warnx("invalid mask preset %u", i + 1);
+			goto err_unmap;
+		}
+	}
+
+	if (preset_map)
+		munmap((void *)preset_map, preset_map_len);
+
+	preset_map = map;
+	preset_map_len = st.st_size;
+	preset_descs = descs;
+	preset_count = hdr->count;
+	preset_active = 0;
+
+	return 0;
+
+err_unmap:
+	munmap(map, st.st_size);
+
+	return -EINVAL;
+}
+
+unsigned int diag_presets_count(void)
+{
+	return preset_count;
+}
+
+/* Return the name of preset @id, which might not be NUL terminated */
+const char *diag_preset_name(unsigned int id)
+{
+	if (!id || id > preset_count)
+		return NULL;
+
+	return preset_descs[id - 1].name;
+}
+
+/**
+ * diag_preset_select() - select the preset the peripherals should use
+ * @id:		preset id, starting at 1
+ *
+ * Return: 0 on success, -EINVAL if there's no such preset
+ */
+int diag_preset_select(unsigned int id)
+{
+	if (!id || id > preset_count)
+		return -EINVAL;
+
+	preset_active = id;
+
+	return 0;
+}
+
+/* Return the id of the selected preset, 0 if none */
+unsigned int diag_preset_active(void)
+{
+	return preset_active;
+}
+
+/**
+ * diag_preset_next() - iterate over the masks of a preset
+ * @id:		preset id, starting at 1
+ * @rec:	previous mask, or NULL to start from the first one
+ *
+ * Return: next mask of the preset, NULL when done
+ */
+const struct diag_preset_rec *diag_preset_next(unsigned int id,
+					       const struct diag_preset_rec *rec)
+{
+	const struct diag_preset_desc *desc;
+	const char *end;
+
+	if (!id || id > preset_count)
+		return NULL;
+
+	desc = &preset_descs[id - 1];
+	end = preset_map + desc->offset + desc->len;
+
+	if (!rec)
+		rec = (const struct diag_preset_rec *)(preset_map + desc->offset);
+	else
+		rec = (const struct diag_preset_rec *)(rec->data + rec->len);
+
+	return (const char *)rec < end ? rec : NULL;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __PRESETS_H__
+#define __PRESETS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/*
+ * A preset file holds named sets of masks, which are handed to the
+ * peripherals once so that switching between them takes a single control
+ * message. All fields are little endian:
+ *
+ *	struct diag_preset_file_hdr
+ *	struct diag_preset_desc, one per preset
+ *	struct diag_preset_rec..., referenced by the descriptors
+ *
+ * Presets are numbered from 1, in the order of their descriptors.
+ */
+#define DIAG_PRESET_MAGIC	"DPRE"
+#define DIAG_PRESET_VERSION	1
+#define DIAG_PRESET_NAME_LEN	32
+
+#define DIAG_PRESET_REC_MSG	1
+#define DIAG_PRESET_REC_LOG	2
+#define DIAG_PRESET_REC_EVENT	3
+
+struct diag_preset_file_hdr {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+} __packed;
+
+/**
+ * struct diag_preset_desc - preset descriptor
+ * @name:	name of the preset, NUL padded
+ * @offset:	offset of the preset's records, from the start of the file
+ * @len:	total size of the preset's records
+ */
+struct diag_preset_desc {
+	char name[DIAG_PRESET_NAME_LEN];
+	uint32_t offset;
+	uint32_t len;
+} __packed;
+
+/**
+ * struct diag_preset_rec - mask of a preset
+ * @type:	DIAG_PRESET_REC_MSG, DIAG_PRESET_REC_LOG or DIAG_PRESET_REC_EVENT
+ * @id:		first SSID of a message mask, equip ID of a log mask
+ * @num_items:	number of SSIDs, up to MAX_SSID_PER_RANGE, log items or
+ *		events covered by @data
+ * @len:	size of @data, 4 bytes per SSID or one bit per log item or event
+ * @data:	mask
+ */
+struct diag_preset_rec {
+	uint16_t type;
+	uint16_t id;
+	uint32_t num_items;
+	uint32_t len;
+	uint8_t data[];
+} __packed;
+
+int diag_presets_load(const char *path);
+unsigned int diag_presets_count(void);
+const char *diag_preset_name(unsigned int id);
+int diag_preset_select(unsigned int id);
+unsigned int diag_preset_active(void);
+const struct diag_preset_rec *diag_preset_next(unsigned int id,
+					       const struct diag_preset_rec *rec);
+
+#endif
@@ -38,6 +38,7 @@
 #include "diag.h"
 #include "dm.h"
 #include "hdlc.h"
+#include "mbuf.h"
 #include "peripheral.h"
 #include "util.h"
 
@@ -45,21 +46,50 @@
 #define DIAG_CMD_RSP_BAD_PARAMS				0x14
 #define DIAG_CMD_RSP_BAD_LENGTH				0x15
 
-struct list_head fallback_cmds = LIST_INIT(fallback_cmds);
-struct list_head common_cmds = LIST_INIT(common_cmds);
+/* Requests awaiting a response, beyond which the oldest are forgotten */
+#define DIAG_MAX_PENDING_CMDS	64
 
-int hdlc_enqueue_flow(struct list_head *queue, const void *msg, size_t msglen,
-		      struct watch_flow *flow)
+/**
+ * struct diag_pending_cmd - command forwarded to a peripheral
+ * @key:	command key of the request
+ * @peripheral:	peripheral the request was forwarded to
+ * @client:	client which issued the request
+ * @node:	entry in the pending_cmds list, oldest first
+ */
+struct diag_pending_cmd {
+	unsigned int key;
+	struct peripheral *peripheral;
+	struct diag_client *client;
+
+	struct list_head node;
+};
+
+static struct cmd_table fallback_cmds;
+static struct cmd_table common_cmds;
+
+static struct list_head pending_cmds = LIST_INIT(pending_cmds);
+static unsigned int pending_count;
+
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen)
 {
+	struct mbuf *mbuf;
 	size_t outlen;
-	void *outbuf;
 
-	outbuf = hdlc_encode(msg, msglen, &outlen);
-	if (!outbuf)
+	/* Encode into the tailroom, then claim what was used */
+	mbuf = mbuf_alloc_room(0, 0, hdlc_encode_size(msg, msglen));
+	if (!mbuf)
 		err(1, "failed to allocate hdlc destination buffer");
 
-	queue_push_flow(queue, outbuf, outlen, flow);
-	free(outbuf);
+	outlen = hdlc_encode(mbuf->data, msg, msglen);
+	mbuf_put(mbuf, outlen);
+
+	return mbuf;
+}
+
+int hdlc_enqueue_flow(struct list_head *queue, const void *msg, size_t msglen,
+		      struct watch_flow *flow)
+{
+	queue_push_mbuf(queue, hdlc_encode_mbuf(msg, msglen), flow);
 
 	return 0;
 }
@@ -69,37 +99,136 @@ int hdlc_enqueue(struct list_head *queue, const void *msg, size_t msglen)
 	return hdlc_enqueue_flow(queue, msg, msglen, NULL);
 }
 
-static int diag_cmd_dispatch(struct diag_client *client, uint8_t *ptr,
-			     size_t len)
+static unsigned int diag_cmd_key(const uint8_t *ptr)
 {
-	struct list_head *item;
-	struct diag_cmd *dc;
-	unsigned int key;
-	int handled = 0;
-
 	if (ptr[0] == DIAG_CMD_SUBSYS_DISPATCH ||
 	    ptr[0] == DIAG_CMD_SUBSYS_DISPATCH_V2)
-		key = ptr[0] << 24 | ptr[1] << 16 | ptr[3] << 8 | ptr[2];
+		return ptr[0] << 24 | ptr[1] << 16 | ptr[3] << 8 | ptr[2];
 	else
-		key = 0xff << 24 | 0xff << 16 | ptr[0];
+		return 0xff << 24 | 0xff << 16 | ptr[0];
+}
+
+static void diag_cmd_track(struct peripheral *peripheral,
+			   struct diag_client *client, unsigned int key)
+{
+	struct diag_pending_cmd *pending;
+
+	if (pending_count == DIAG_MAX_PENDING_CMDS) {
+		pending = list_entry_first(&pending_cmds,
+					   struct diag_pending_cmd, node);
+		list_del(&pending->node);
+		pending_count--;
+	} else {
+		pending = malloc(sizeof(*pending));
+		if (!pending)
+			err(1, "failed to allocate pending command");
+	}
+
+	pending->key = key;
+	pending->peripheral = peripheral;
+	pending->client = client;
+
+	list_add(&pending_cmds, &pending->node);
+	pending_count++;
+}
+
+/**
+ * diag_cmd_response() - deliver a command response from a peripheral
+ * @peripheral:	peripheral the response was received from
+ * @mbuf:	mbuf holding the raw response, ownership is transferred
+ *
+ * The response goes to the client with the oldest request for the same
+ * command outstanding with @peripheral. Responses matching no request are
+ * broadcast to all clients.
+ */
+void diag_cmd_response(struct peripheral *peripheral, struct mbuf *mbuf)
+{
+	struct diag_pending_cmd *pending;
+	const uint8_t *ptr = (uint8_t *)mbuf->data;
+	size_t len = mbuf->size;
+	unsigned int key;
+
+	/* Error responses carry the rejected request after the error code */
+	if (len && (ptr[0] == DIAG_CMD_RSP_BAD_COMMAND ||
+		    ptr[0] == DIAG_CMD_RSP_BAD_PARAMS ||
+		    ptr[0] == DIAG_CMD_RSP_BAD_LENGTH)) {
+		ptr++;
+		len--;
+	}
+
+	if (!len)
+		goto broadcast;
 
-	list_for_each(item, &common_cmds) {
-		dc = container_of(item, struct diag_cmd, node);
-		if (key < dc->first || key > dc->last)
+	if ((ptr[0] == DIAG_CMD_SUBSYS_DISPATCH ||
+	     ptr[0] == DIAG_CMD_SUBSYS_DISPATCH_V2) && len < 4)
+		goto broadcast;
+
+	key = diag_cmd_key(ptr);
+
+	list_for_each_entry(pending, &pending_cmds, node) {
+		if (pending->peripheral != peripheral || pending->key != key)
 			continue;
 
-		return dc->cb(client, ptr, len);
+		list_del(&pending->node);
+		pending_count--;
+
+		dm_send_mbuf(pending->client, mbuf);
+		free(pending);
+		return;
 	}
 
-	list_for_each(item, &diag_cmds) {
-		dc = container_of(item, struct diag_cmd, node);
-		if (key < dc->first || key > dc->last)
+broadcast:
+	dm_broadcast_response(mbuf);
+}
+
+/**
+ * diag_cmd_forget() - drop the requests outstanding with a peripheral
+ * @peripheral:	peripheral going away
+ */
+void diag_cmd_forget(struct peripheral *peripheral)
+{
+	struct diag_pending_cmd *pending;
+	struct diag_pending_cmd *next;
+
+	list_for_each_entry_safe(pending, next, &pending_cmds, node) {
+		if (pending->peripheral != peripheral)
 			continue;
 
-		if (dc->cb)
+		list_del(&pending->node);
+		pending_count--;
+		free(pending);
+	}
+}
+
+static int diag_cmd_dispatch(struct diag_client *client, uint8_t *ptr,
+			     size_t len)
+{
+	struct diag_cmd **cmds;
+	struct diag_cmd *dc;
+	unsigned int key;
+	int handled = 0;
+	size_t count;
+	size_t i;
+
+	key = diag_cmd_key(ptr);
+
+	count = cmd_table_lookup(&common_cmds, key, &cmds);
+	if (count)
+		return cmds[0]->cb(client, ptr, len);
+
+	count = cmd_table_lookup(&diag_cmds, key, &cmds);
+	for (i = 0; i < count; i++) {
+		dc = cmds[i];
+
+		if (dc->cb) {
 			dc->cb(client, ptr, len);
-		else
+		} else if (dc->peripheral) {
+			diag_cmd_track(dc->peripheral, client, key);
 			peripheral_send(dc->peripheral, ptr, len);
+		} else {
+			/* Removed since the lookup */
+			continue;
+		}
 
 		handled++;
 	}
@@ -107,12 +236,9 @@ static int diag_cmd_dispatch(struct diag_client *client, uint8_t *ptr,
 	if (handled)
 		return 0;
 
-	list_for_each_entry(dc, &fallback_cmds, node) {
-		if (key < dc->first || key > dc->last)
-			continue;
-
-		return dc->cb(client, ptr, len);
-	}
+	count = cmd_table_lookup(&fallback_cmds, key, &cmds);
+	if (count)
+		return cmds[0]->cb(client, ptr, len);
 
 	return -ENOENT;
 }
@@ -161,53 +287,26 @@ void register_fallback_cmd(unsigned int cmd,
 			   int(*cb)(struct diag_client *client,
 				    const void *buf, size_t len))
 {
-	struct diag_cmd *dc;
 	unsigned int key = 0xffff0000 | cmd;
 
-	dc = calloc(1, sizeof(*dc));
-	if (!dc)
-		err(1, "failed to allocate diag command\n");
-
-	dc->first = key;
-	dc->last = key;
-	dc->cb = cb;
-
-	list_add(&fallback_cmds, &dc->node);
+	cmd_table_add(&fallback_cmds, key, key, NULL, cb);
 }
 
 void register_fallback_subsys_cmd(unsigned int subsys, unsigned int cmd,
 				  int(*cb)(struct diag_client *client,
 					   const void *buf, size_t len))
 {
-	struct diag_cmd *dc;
 	unsigned int key = DIAG_CMD_SUBSYS_DISPATCH << 24 |
 			   (subsys & 0xff) << 16 | cmd;
 
-	dc = calloc(1, sizeof(*dc));
-	if (!dc)
-		err(1, "failed to allocate diag command\n");
-
-	dc->first = key;
-	dc->last = key;
-	dc->cb = cb;
-
-	list_add(&fallback_cmds, &dc->node);
+	cmd_table_add(&fallback_cmds, key, key, NULL, cb);
 }
 
 void register_common_cmd(unsigned int cmd, int(*cb)(struct diag_client *client,
 						    const void *buf,
 						    size_t len))
 {
-	struct diag_cmd *dc;
 	unsigned int key = 0xffff0000 | cmd;
 
-	dc = calloc(1, sizeof(*dc));
-	if (!dc)
-		err(1, "failed to allocate diag command\n");
-
-	dc->first = key;
-	dc->last = key;
-	dc->cb = cb;
-
-	list_add(&common_cmds, &dc->node);
+	cmd_table_add(&common_cmds, key, key, NULL, cb);
 }
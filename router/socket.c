@@ -50,6 +50,8 @@
 
 #define APPS_BUF_SIZE 16384
 
+#define SOCKET_RECV_BUF_SIZE	(64 * 1024)
+
 int diag_sock_connect(const char *hostname, unsigned short port)
 {
 	struct sockaddr_in addr;
@@ -81,7 +83,7 @@ int diag_sock_connect(const char *hostname, unsigned short port)
 
 	printf("Connected to %s:%d\n", hostname, port);
 
-	dm = dm_add("DIAG CLIENT", fd, fd, true);
+	dm = dm_add("DIAG CLIENT", fd, fd, true, SOCKET_RECV_BUF_SIZE);
 	dm_enable(dm);
 
 	return fd;
@@ -43,6 +43,8 @@
 
 #define APPS_BUF_SIZE 16384
 
+#define UART_RECV_BUF_SIZE	(16 * 1024)
+
 static unsigned int check_baudrate(unsigned int baudrate)
 {
 	switch (baudrate)
@@ -106,7 +108,7 @@ int diag_uart_open(const char *uartname, unsigned int baudrate)
 
 	printf("Connected to %s@%d\n", uartname, baudrate);
 
-	dm = dm_add("UART client", fd, fd, true);
+	dm = dm_add("UART client", fd, fd, true, UART_RECV_BUF_SIZE);
 	dm_enable(dm);
 
 	return fd;
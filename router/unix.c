@@ -58,7 +58,7 @@ static int unix_listen(int fd, void *data)
 		return 0;
 	}
 
-	dm = dm_add("UNIX", client, client, false);
+	dm = dm_add("UNIX", client, client, false, 0);
 	dm_enable(dm);
 
 	return 0;
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "util.h"
+
+/**
+ * DOC: io_uring I/O engine
+ *
+ * Minimal wrapper around the raw io_uring system calls, used by the watch
+ * code to queue reads and writes of mbufs. Entries are queued in the
+ * submission ring without any system call and are handed to the kernel in
+ * one batch by uring_submit(). Completions are reaped directly from the
+ * shared completion ring; the ring file descriptor becomes readable as
+ * completions are posted, so it can be monitored by the event loop.
+ */
+
+/**
+ * struct uring - io_uring context
+ * @fd:		io_uring file descriptor
+ * @entries:	number of submission queue entries
+ * @sq_ring:	mapping of the submission ring
+ * @sq_ring_len: length of @sq_ring
+ * @cq_ring:	mapping of the completion ring, may alias @sq_ring
+ * @cq_ring_len: length of @cq_ring
+ * @sqes:	mapping of the submission queue entries
+ * @sqes_len:	length of @sqes
+ * @sq_head:	consumer index of the submission ring, owned by the kernel
+ * @sq_tail:	producer index of the submission ring
+ * @sq_mask:	index mask of the submission ring
+ * @sq_array:	indirection array of the submission ring
+ * @cq_head:	consumer index of the completion ring
+ * @cq_tail:	producer index of the completion ring, owned by the kernel
+ * @cq_mask:	index mask of the completion ring
+ * @cqes:	completion queue entries
+ * @pending:	number of queued, but not yet submitted, entries
+ */
+struct uring {
+	int fd;
+	unsigned int entries;
+
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned int pending;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+#ifdef __NR_io_uring_setup
+	return syscall(__NR_io_uring_setup, entries, p);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+#ifdef __NR_io_uring_enter
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/**
+ * uring_new() - create a new io_uring context
+ * @entries:	minimum number of submission queue entries
+ *
+ * Return: new io_uring context, or NULL with errno set if io_uring is not
+ * available
+ */
+struct uring *uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	int saved_errno;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		goto err_free;
+
+	ring->entries = p.sq_entries;
+
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_ring_len = ring->cq_ring_len = MAX(ring->sq_ring_len,
+							    ring->cq_ring_len);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	return ring;
+
+err_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+err_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_len);
+err_close:
+	saved_errno = errno;
+	close(ring->fd);
+	errno = saved_errno;
+err_free:
+	free(ring);
+
+	return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	free(ring);
+}
+
+int uring_fd(struct uring *ring)
+{
+	return ring->fd;
+}
+
+/**
+ * uring_prep_rw() - queue a read or write request
+ * @ring:	io_uring context
+ * @fd:		file descriptor to operate on
+ * @write:	true for a write request, false for a read
+ * @buf:	data buffer
+ * @len:	length of @buf
+ * @user_data:	cookie passed back on completion
+ *
+ * The request is not handed to the kernel until uring_submit() is called.
+ *
+ * Return: 0 on success, -EBUSY if the submission ring is full
+ */
+int uring_prep_rw(struct uring *ring, int fd, bool write, void *buf,
+		  size_t len, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	if (tail - head >= ring->entries)
+		return -EBUSY;
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return 0;
+}
+
+/**
+ * uring_submit() - hand all queued requests to the kernel
+ * @ring:	io_uring context
+ *
+ * Return: number of requests submitted, negative errno on failure
+ */
+int uring_submit(struct uring *ring)
+{
+	int ret;
+
+	if (!ring->pending)
+		return 0;
+
+	ret = io_uring_enter(ring->fd, ring->pending, 0, 0);
+	if (ret < 0)
+		return -errno;
+
+	ring->pending -= ret;
+
+	return ret;
+}
+
+/**
+ * uring_reap() - process posted completions
+ * @ring:	io_uring context
+ * @cb:		callback invoked with the user_data and result of each request
+ *
+ * Return: number of completions processed
+ */
+unsigned int uring_reap(struct uring *ring,
+			void (*cb)(uint64_t user_data, int res))
+{
+	struct io_uring_cqe *cqe;
+	unsigned int count = 0;
+	unsigned int head;
+	unsigned int tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+
+		cb(cqe->user_data, cqe->res);
+
+		head++;
+		count++;
+
+		/*
+		 * Release the entry before invoking further callbacks, which
+		 * might queue and submit new requests.
+		 */
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	return count;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring;
+
+#if HAS_IO_URING
+struct uring *uring_new(unsigned int entries);
+void uring_free(struct uring *ring);
+int uring_fd(struct uring *ring);
+int uring_prep_rw(struct uring *ring, int fd, bool write, void *buf,
+		  size_t len, uint64_t user_data);
+int uring_submit(struct uring *ring);
+unsigned int uring_reap(struct uring *ring,
+			void (*cb)(uint64_t user_data, int res));
+#else
+static inline struct uring *uring_new(unsigned int entries)
+{
+	return NULL;
+}
+
+static inline void uring_free(struct uring *ring)
+{
+}
+
+static inline int uring_fd(struct uring *ring)
+{
+	return -1;
+}
+
+static inline int uring_prep_rw(struct uring *ring, int fd, bool write,
+				void *buf, size_t len, uint64_t user_data)
+{
+	return -ENOSYS;
+}
+
+static inline int uring_submit(struct uring *ring)
+{
+	return -ENOSYS;
+}
+
+static inline unsigned int uring_reap(struct uring *ring,
+				      void (*cb)(uint64_t user_data, int res))
+{
+	return 0;
+}
+#endif
+
+#endif
@@ -59,6 +59,20 @@
 
 #define USB_PROTOCOL_DIAG	0x30
 
+/* Number of bulk-in transfers kept queued to the UDC */
+#define USB_BULK_IN_DEPTH	8
+
+/* The host is expected to keep up, so hold back peripherals rather than drop */
+#define USB_QUEUE_BYTES		(8 * 1024 * 1024)
+#define USB_QUEUE_PACKETS	8192
+
+/* Time, in milliseconds, a partially filled bulk-in transfer is held back */
+#define USB_BULK_IN_DEADLINE	5
+
+/* Number and size of bulk-out transfers kept posted to the UDC */
+#define USB_BULK_OUT_DEPTH	4
+#define USB_BULK_OUT_SIZE	16384
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define cpu_to_le16(x)		(x)
 #define cpu_to_le32(x)		(x)
@@ -212,6 +226,9 @@ struct usb_handle {
 
 	struct diag_client *dm;
 	struct list_head outq;
+	bool reading;
+
+	struct hdlc_decoder recv_decoder;
 };
 
 static int ffs_diag_init(const char *ffs_name, struct usb_handle *h)
@@ -278,22 +295,17 @@ err_out:
 
 static int diag_ffs_recv(struct mbuf *mbuf, void *data)
 {
-	struct hdlc_decoder recv_decoder;
-	struct circ_buf recv_buf;
 	struct usb_handle *ffs = data;
+	const void *ptr = mbuf->data;
+	size_t len = mbuf->offset;
 	size_t msglen;
 	void *msg;
 
-	memset(&recv_decoder, 0, sizeof(recv_decoder));
-
-	memcpy(recv_buf.buf, mbuf->data, mbuf->offset);
-	recv_buf.tail = 0;
-	recv_buf.head = mbuf->offset;
-
 	// print_hex_dump("[USB]", mbuf->data, mbuf->offset);
 
+	/* Frames may span transfers, the decoder carries partial ones over */
 	for (;;) {
-		msg = hdlc_decode_one(&recv_decoder, &recv_buf, &msglen);
+		msg = hdlc_decode_buf(&ffs->recv_decoder, &ptr, &len, &msglen);
 		if (!msg)
 			break;
 
@@ -322,7 +334,13 @@ static int ep0_recv(int fd, void *data)
 
 	switch (event.type) {
 	case FUNCTIONFS_ENABLE:
-		watch_add_readq(ffs->bulk_out, &ffs->outq, diag_ffs_recv, ffs);
+		if (!ffs->reading) {
+			watch_add_readq(ffs->bulk_out, &ffs->outq,
+					diag_ffs_recv, ffs);
+			watch_use_aio(ffs->bulk_out);
+			watch_set_queue_depth(ffs->bulk_out, USB_BULK_OUT_DEPTH);
+			ffs->reading = true;
+		}
 		dm_enable(ffs->dm);
 		break;
 	case FUNCTIONFS_DISABLE:
@@ -333,32 +351,48 @@ static int ep0_recv(int fd, void *data)
 	return 0;
 }
 
-int diag_usb_open(const char *ffs_name)
+/**
+ * diag_usb_open() - register the FunctionFS based USB client
+ * @ffs_name:	path of the mounted FunctionFS instance
+ * @xfer_size:	size up to which messages are packed in bulk-in transfers,
+ *		0 to send each message as a transfer of its own
+ */
+int diag_usb_open(const char *ffs_name, size_t xfer_size)
 {
 	struct usb_handle *ffs;
 	struct mbuf *out_buf;
 	int ret;
+	int i;
 
 	ffs = calloc(1, sizeof(struct usb_handle));
 	if (!ffs)
 		err(1, "couldn't allocate usb_handle");
 
-	out_buf = mbuf_alloc(16384);
-	if (!out_buf)
-		err(1, "couldn't allocate usb out buffer");
-
 	ret = ffs_diag_init(ffs_name, ffs);
 	if (ret < 0) {
 		free(ffs);
 		return -1;
 	}
 
+	/* Keep several reads posted, so that command bursts aren't throttled */
 	list_init(&ffs->outq);
-	list_add(&ffs->outq, &out_buf->node);
+	for (i = 0; i < USB_BULK_OUT_DEPTH; i++) {
+		out_buf = mbuf_alloc(USB_BULK_OUT_SIZE);
+		if (!out_buf)
+			err(1, "couldn't allocate usb out buffer");
+
+		list_add(&ffs->outq, &out_buf->node);
+	}
 
 	watch_add_readfd(ffs->ep0, ep0_recv, ffs, NULL);
 
-	ffs->dm = dm_add("USB client", -1, ffs->bulk_in, true);
+	ffs->dm = dm_add("USB client", -1, ffs->bulk_in, true, 0);
+	dm_set_queue_limit(ffs->dm, USB_QUEUE_BYTES, USB_QUEUE_PACKETS,
+			   DM_BLOCK_PERIPHERAL);
+	/* FunctionFS only completes requests in order if they're queued by AIO */
+	watch_use_aio(ffs->bulk_in);
+	watch_set_queue_depth(ffs->bulk_in, USB_BULK_IN_DEPTH);
+	watch_set_aggregation(ffs->bulk_in, xfer_size, USB_BULK_IN_DEADLINE);
 
 	return 0;
 }
@@ -28,73 +28,194 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/syscall.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <linux/aio_abi.h>
 
-#include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "list.h"
 #include "mbuf.h"
+#include "uring.h"
 #include "util.h"
 #include "watch.h"
 
-#define FLOW_WATERMARK	10
+/* Default bytes outstanding at which a flow blocks, and unblocks again */
+#define FLOW_HIGH_WATERMARK	(256 * 1024)
+#define FLOW_LOW_WATERMARK	(64 * 1024)
+
+#define WATCH_MAX_EVENTS	32
+#define WATCH_MAX_DEPTH		16
+#define WATCH_MAX_INFLIGHT	256
+#define WATCH_RETRY_INTERVAL	10
+
+enum watch_io_engine {
+	WATCH_IO_AIO,
+	WATCH_IO_URING,
+};
 
 /**
  * struct watch_flow - flow control context
- * @packets: number of outstanding packets
+ * @bytes:	number of bytes outstanding
+ * @high:	@bytes above which the flow blocks
+ * @low:	@bytes at or below which a blocked flow unblocks
+ * @blocked:	the gated read watches are disarmed
+ * @blocked_since: time the flow last blocked, in nanoseconds
+ * @blocked_time: total time spent blocked, in nanoseconds, until @blocked_since
+ * @blocked_count: number of times the flow has blocked
+ * @watches:	read watches gated by this flow
  */
 struct watch_flow {
-	int packets;
+	size_t bytes;
+	size_t high;
+	size_t low;
+
+	bool blocked;
+	uint64_t blocked_since;
+	uint64_t blocked_time;
+	unsigned long blocked_count;
+
+	struct list_head watches;
+};
+
+struct watch;
+
+/**
+ * struct watch_req - queued I/O request
+ * @iocb:	AIO control block
+ * @w:		watch owning the request
+ * @mbuf:	buffer being read or written
+ * @queue:	queue @mbuf was taken from, and is put back on upon -EAGAIN
+ * @res:	result of the request, valid once @done is set
+ * @done:	request has completed, but is not yet delivered
+ */
+struct watch_req {
+	struct iocb iocb;
+	struct watch *w;
+	struct mbuf *mbuf;
+	struct list_head *queue;
+	int res;
+	bool done;
 };
 
+/**
+ * struct watch - file descriptor watch
+ * @fd:		file descriptor being watched
+ * @cb:		read watch callback
+ * @data:	private data passed to callbacks
+ * @queue:	queue of mbufs to be read into or written from @fd
+ * @prio_queue:	queue of mbufs written ahead of those on @queue, or NULL
+ * @reqs:	ring of @depth in-flight requests for queue watches
+ * @depth:	maximum number of in-flight requests
+ * @head:	index in @reqs of the oldest in-flight request
+ * @used:	number of in-flight requests
+ * @is_write:	queue watch writes, rather than reads, its mbufs
+ * @stalled:	queue watch got -EAGAIN and awaits the retry timer
+ * @use_aio:	queue watch is submitted through Linux AIO, whatever the engine
+ * @agg_size:	size up to which queued writes are packed together, 0 if off
+ * @agg_deadline: time, in milliseconds, a partial aggregate may be held
+ * @agg_timer:	timer releasing a partial aggregate as @agg_deadline passes
+ * @agg_flush:	@agg_deadline has passed, submit the partial aggregate
+ * @removed:	watch has been removed, but is still referenced
+ * @flow:	flow control context gating a read watch
+ * @flow_node:	entry in the list of watches gated by @flow
+ * @aio_complete: queue watch completion callback
+ * @node:	entry in the list of watches of the same kind
+ */
 struct watch {
 	int fd;
 	int (*cb)(int, void*);
 	void *data;
 	struct list_head *queue;
+	struct list_head *prio_queue;
 
-	struct iocb iocb;
-	struct mbuf *pending_aio;
+	struct watch_req *reqs;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int used;
 
 	bool is_write;
+	bool stalled;
+	bool use_aio;
+	bool removed;
+
+	size_t agg_size;
+	unsigned int agg_deadline;
+	struct watch_timer *agg_timer;
+	bool agg_flush;
 
 	struct watch_flow *flow;
+	struct list_head flow_node;
 
 	int (*aio_complete)(struct mbuf *, void*);
 
 	struct list_head node;
 };
 
-struct timer {
+/**
+ * struct watch_timer - timer
+ * @cb:		callback invoked as the timer expires
+ * @data:	private data passed to @cb
+ * @interval:	timeout, in milliseconds
+ * @repeat:	rearm the timer after it has fired
+ * @expires:	CLOCK_MONOTONIC expiry time, in nanoseconds
+ * @index:	position in the timer heap
+ */
+struct watch_timer {
 	void (*cb)(void *);
 	void *data;
 	unsigned int interval;
 	bool repeat;
 
-	struct timeval tick;
-
-	struct list_head node;
+	uint64_t expires;
+	unsigned int index;
 };
 
-static struct list_head timers = LIST_INIT(timers);
+/* Min-heap of pending timers, ordered by expiry time */
+static struct watch_timer **timer_heap;
+static unsigned int timer_count;
+static unsigned int timer_size;
+
+static int timer_fd = -1;
+static uint64_t timer_armed;
+
+/* Timer being fired, and whether its callback cancelled it */
+static struct watch_timer *timer_running;
+static bool timer_cancelled;
 
 static struct list_head read_watches = LIST_INIT(read_watches);
 static struct list_head aio_watches = LIST_INIT(aio_watches);
 static struct list_head quit_watches = LIST_INIT(quit_watches);
+static struct list_head dead_watches = LIST_INIT(dead_watches);
 static bool do_watch_quit;
 
+static int epoll_fd = -1;
+
+#if HAS_IO_URING
+static enum watch_io_engine io_engine = WATCH_IO_URING;
+#else
+static enum watch_io_engine io_engine = WATCH_IO_AIO;
+#endif
+static struct uring *uring;
+static unsigned int io_inflight;
+
+/* Identify the I/O completion notifiers among the epoll events */
+static char aio_notifier;
+static char uring_notifier;
+static bool retry_pending;
+
 typedef unsigned long aio_context_t;
 
 static long io_destroy(aio_context_t ctx)
@@ -125,39 +246,161 @@ static long io_submit(aio_context_t ctx, long n, struct iocb **paiocb)
 	return syscall(__NR_io_submit, ctx, n, paiocb);
 }
 
+static int watch_epoll_fd(void)
+{
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+			err(1, "failed to create epoll instance");
+	}
+
+	return epoll_fd;
+}
+
+/**
+ * watch_arm() - update the epoll interest of a read watch
+ * @w:		read watch
+ * @armed:	whether or not to poll the watch for input
+ *
+ * A disarmed watch is taken out of the epoll set altogether, as EPOLLHUP
+ * and EPOLLERR are reported regardless of the events requested, and would
+ * have the event loop spin until the watch is armed again.
+ */
+static void watch_arm(struct watch *w, bool armed)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = w,
+	};
+	int ret;
+
+	if (armed)
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, w->fd, &ev);
+	else
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_DEL, w->fd, NULL);
+	if (ret < 0)
+		warn("failed to update epoll watch of fd %d", w->fd);
+}
+
+static uint64_t watch_now(void)
+{
+	struct timespec ts;
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ret < 0)
+		err(1, "failed to read monotonic clock");
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 struct watch_flow *watch_flow_new(void)
 {
-	return calloc(1, sizeof(struct watch_flow));
+	struct watch_flow *flow;
+
+	flow = calloc(1, sizeof(struct watch_flow));
+	if (!flow)
+		return NULL;
+
+	flow->high = FLOW_HIGH_WATERMARK;
+	flow->low = FLOW_LOW_WATERMARK;
+	list_init(&flow->watches);
+
+	return flow;
+}
+
+/**
+ * watch_flow_set_watermarks() - configure the hysteresis of a flow
+ * @flow:	flow control context
+ * @high:	bytes outstanding above which the gated read watches are paused
+ * @low:	bytes outstanding at which paused read watches resume
+ *
+ * Return: 0 on success, -EINVAL if @low exceeds @high
+ */
+int watch_flow_set_watermarks(struct watch_flow *flow, size_t high, size_t low)
+{
+	if (low > high)
+		return -EINVAL;
+
+	flow->high = high;
+	flow->low = low;
+
+	return 0;
 }
 
-void watch_flow_inc(struct watch_flow *flow)
+/**
+ * watch_flow_stats() - print the occupancy and blocking of a flow
+ * @flow:	flow control context
+ * @fp:		stream to print to
+ * @name:	name of the flow, for the row printed
+ */
+void watch_flow_stats(struct watch_flow *flow, FILE *fp, const char *name)
+{
+	uint64_t blocked = flow->blocked_time;
+
+	if (flow->blocked)
+		blocked += watch_now() - flow->blocked_since;
+
+	fprintf(fp, "%-16s %10zu %10zu %10zu %8lu %12llu\n", name,
+		flow->bytes, flow->high, flow->low, flow->blocked_count,
+		(unsigned long long)(blocked / 1000000));
+}
+
+static bool watch_flow_blocked(struct watch_flow *flow)
+{
+	return flow && flow->blocked;
+}
+
+static void watch_flow_arm(struct watch_flow *flow, bool armed)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &flow->watches, flow_node)
+		watch_arm(w, armed);
+}
+
+void watch_flow_inc(struct watch_flow *flow, size_t bytes)
 {
 	if (!flow)
 		return;
 
-	flow->packets++;
+	flow->bytes += bytes;
+
+	/* Disarm the gated read watches as the flow becomes blocked */
+	if (!flow->blocked && flow->bytes > flow->high) {
+		flow->blocked = true;
+		flow->blocked_since = watch_now();
+		flow->blocked_count++;
+		watch_flow_arm(flow, false);
+	}
 }
 
-static void watch_flow_dec(struct watch_flow *flow)
+static void watch_flow_dec(struct watch_flow *flow, size_t bytes)
 {
 	if (!flow)
 		return;
 
-	if (!flow->packets)
+	if (flow->bytes < bytes) {
 		fprintf(stderr, "unbalanced flow control\n");
-	else
-		flow->packets--;
-}
+		return;
+	}
 
-static bool watch_flow_blocked(struct watch_flow *flow)
-{
-	return flow && flow->packets > FLOW_WATERMARK;
+	flow->bytes -= bytes;
+
+	/* Re-arm the gated read watches once the flow has drained */
+	if (flow->blocked && flow->bytes <= flow->low) {
+		flow->blocked = false;
+		flow->blocked_time += watch_now() - flow->blocked_since;
+		watch_flow_arm(flow, true);
+	}
 }
 
 int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
 		     struct watch_flow *flow)
 {
+	struct epoll_event ev;
 	struct watch *w;
+	int ret;
 
 	w = calloc(1, sizeof(struct watch));
 	if (!w)
@@ -168,11 +411,74 @@ int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
 	w->data = data;
 	w->flow = flow;
 
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+
+	/* A watch added to a blocked flow is armed as the flow unblocks */
+	if (!watch_flow_blocked(flow)) {
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, fd, &ev);
+		if (ret < 0) {
+			warn("failed to add fd %d to epoll", fd);
+			free(w);
+			return -errno;
+		}
+	}
+
+	if (flow)
+		list_add(&flow->watches, &w->flow_node);
+
 	list_add(&read_watches, &w->node);
 
 	return 0;
 }
 
+/*
+ * Read watches might be removed from within callbacks while the event loop
+ * still holds references to them, so defer the actual free until the loop
+ * is done processing the current batch of events.
+ */
+static void watch_remove_read(struct watch *w)
+{
+	if (!watch_flow_blocked(w->flow))
+		epoll_ctl(watch_epoll_fd(), EPOLL_CTL_DEL, w->fd, NULL);
+
+	if (w->flow)
+		list_del(&w->flow_node);
+
+	list_del(&w->node);
+
+	w->removed = true;
+	list_add(&dead_watches, &w->node);
+}
+
+static void watch_free_dead(void)
+{
+	struct watch *next;
+	struct watch *w;
+
+	list_for_each_entry_safe(w, next, &dead_watches, node) {
+		free(w->reqs);
+		free(w);
+	}
+
+	list_init(&dead_watches);
+}
+
+static void watch_alloc_reqs(struct watch *w, unsigned int depth)
+{
+	struct watch_req *reqs;
+
+	reqs = calloc(depth, sizeof(*reqs));
+	if (!reqs)
+		err(1, "calloc");
+
+	free(w->reqs);
+
+	w->reqs = reqs;
+	w->depth = depth;
+	w->head = 0;
+}
+
 int watch_add_readq(int fd, struct list_head *queue,
 		    int (*cb)(struct mbuf *mbuf, void *data), void *data)
 {
@@ -182,6 +488,8 @@ int watch_add_readq(int fd, struct list_head *queue,
 	if (!w)
 		err(1, "calloc");
 
+	watch_alloc_reqs(w, 1);
+
 	w->fd = fd;
 	w->aio_complete = cb;
 	w->data = data;
@@ -194,10 +502,36 @@ int watch_add_readq(int fd, struct list_head *queue,
 	return 0;
 }
 
+/**
+ * watch_set_io_engine() - select the engine used for queued I/O
+ * @name:	"aio" for Linux AIO or "uring" for io_uring
+ *
+ * Must be called before watch_run(). If io_uring is selected but not
+ * supported by the running kernel the event loop falls back to Linux AIO.
+ *
+ * Return: 0 on success, -EINVAL if @name is not a supported engine
+ */
+int watch_set_io_engine(const char *name)
+{
+	if (!strcmp(name, "aio")) {
+		io_engine = WATCH_IO_AIO;
+		return 0;
+	}
+
+#if HAS_IO_URING
+	if (!strcmp(name, "uring")) {
+		io_engine = WATCH_IO_URING;
+		return 0;
+	}
+#endif
+
+	return -EINVAL;
+}
+
 static int watch_free_write_aio(struct mbuf *mbuf, void *data)
 {
-	watch_flow_dec(mbuf->flow);
-	free(mbuf);
+	watch_flow_dec(mbuf->flow, mbuf->size);
+	mbuf_free(mbuf);
 
 	return 0;
 }
@@ -210,6 +544,8 @@ int watch_add_writeq(int fd, struct list_head *queue)
 	if (!w)
 		err(1, "calloc");
 
+	watch_alloc_reqs(w, 1);
+
 	w->fd = fd;
 	w->queue = queue;
 	w->data = w;
@@ -223,6 +559,152 @@ int watch_add_writeq(int fd, struct list_head *queue)
 	return 0;
 }
 
+/**
+ * watch_set_queue_depth() - set the number of in-flight requests of a queue
+ * @fd:		file descriptor of the read or write queue watch
+ * @depth:	maximum number of requests to keep in flight
+ *
+ * Keeping multiple requests in flight is only suitable for file descriptors
+ * which complete requests in submission order, such as FunctionFS endpoints.
+ * Requests are only kept in flight together with Linux AIO, see
+ * watch_use_aio(); io_uring doesn't serialize them, so it's handed one at a
+ * time.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_set_queue_depth(int fd, unsigned int depth)
+{
+	struct watch *w;
+	int ret = -ENOENT;
+
+	if (!depth || depth > WATCH_MAX_DEPTH)
+		return -EINVAL;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd != fd)
+			continue;
+
+		if (w->used)
+			return -EBUSY;
+
+		watch_alloc_reqs(w, depth);
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * watch_use_aio() - submit the requests of a queue through Linux AIO
+ * @fd:		file descriptor of the read or write queue watch
+ *
+ * Linux AIO hands requests to drivers implementing it, such as FunctionFS,
+ * in submission order, so that several of them may be kept in flight
+ * whichever engine is selected for the other watches.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_use_aio(int fd)
+{
+	struct watch *w;
+	int ret = -ENOENT;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd != fd)
+			continue;
+
+		if (w->used)
+			return -EBUSY;
+
+		w->use_aio = true;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * watch_set_priority_queue() - add a priority lane to a write queue watch
+ * @fd:		file descriptor of the write queue watch
+ * @queue:	queue of mbufs to write ahead of the regular queue
+ *
+ * Whenever a request is submitted, @queue is drained before the regular
+ * queue of the watch, so that e.g. command responses don't wait behind
+ * streams of log data. Messages on @queue are not held for aggregation.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_set_priority_queue(int fd, struct list_head *queue)
+{
+	struct watch *w;
+	int ret = -ENOENT;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd != fd)
+			continue;
+
+		if (!w->is_write)
+			return -EINVAL;
+
+		w->prio_queue = queue;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * watch_set_aggregation() - pack small writes of a queue into larger ones
+ * @fd:		file descriptor of the write queue watch
+ * @size:	maximum size of a write, 0 to disable aggregation
+ * @deadline:	time, in milliseconds, to wait for a write to fill up
+ *
+ * Consecutive messages of the queue are copied into a single write of up to
+ * @size bytes. A write is issued as soon as the next message wouldn't fit,
+ * or once @deadline has passed since the first message was held back.
+ * Messages of @size bytes or more are written as they are.
+ *
+ * Return: 0 on success, negative errno on failure
+ */
+int watch_set_aggregation(int fd, size_t size, unsigned int deadline)
+{
+	struct watch *w;
+	int ret = -ENOENT;
+
+	list_for_each_entry(w, &aio_watches, node) {
+		if (w->fd != fd)
+			continue;
+
+		if (!w->is_write)
+			return -EINVAL;
+
+		w->agg_size = size;
+		w->agg_deadline = deadline;
+		ret = 0;
+	}
+
+	return ret;
+}
+
+/*
+ * In-flight requests reference the watch, so a watch with requests pending
+ * is released as the last of them completes. The queues belong to the
+ * caller, which may free them right away, so they're no longer referenced.
+ */
+static void watch_remove_aio(struct watch *w)
+{
+	list_del(&w->node);
+
+	watch_cancel_timer(w->agg_timer);
+	w->agg_timer = NULL;
+
+	w->queue = NULL;
+	w->prio_queue = NULL;
+	w->removed = true;
+	if (!w->used)
+		list_add(&dead_watches, &w->node);
+}
+
 void watch_remove_fd(int fd)
 {
 	struct list_head *item;
@@ -231,18 +713,14 @@ void watch_remove_fd(int fd)
 
 	list_for_each_safe(item, next, &read_watches) {
 		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
+		if (w->fd == fd)
+			watch_remove_read(w);
 	}
 
 	list_for_each_safe(item, next, &aio_watches) {
 		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
+		if (w->fd == fd)
+			watch_remove_aio(w);
 	}
 }
 
@@ -254,10 +732,8 @@ void watch_remove_writeq(int fd)
 
 	list_for_each_safe(item, next, &aio_watches) {
 		w = container_of(item, struct watch, node);
-		if (w->fd == fd) {
-			list_del(&w->node);
-			free(w);
-		}
+		if (w->fd == fd)
+			watch_remove_aio(w);
 	}
 }
 
@@ -277,69 +753,221 @@ int watch_add_quit(int (*cb)(int, void*), void *data)
 	return 0;
 }
 
-static void watch_set_timer(struct timer *timer)
+static void watch_timer_swap(unsigned int a, unsigned int b)
 {
-	struct timeval now;
-	struct timeval tv;
+	struct watch_timer *tmp = timer_heap[a];
+
+	timer_heap[a] = timer_heap[b];
+	timer_heap[b] = tmp;
+
+	timer_heap[a]->index = a;
+	timer_heap[b]->index = b;
+}
+
+static void watch_timer_sift_up(unsigned int i)
+{
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (timer_heap[parent]->expires <= timer_heap[i]->expires)
+			break;
+
+		watch_timer_swap(i, parent);
+		i = parent;
+	}
+}
+
+static void watch_timer_sift_down(unsigned int i)
+{
+	unsigned int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= timer_count)
+			break;
+
+		if (child + 1 < timer_count &&
+		    timer_heap[child + 1]->expires < timer_heap[child]->expires)
+			child++;
+
+		if (timer_heap[i]->expires <= timer_heap[child]->expires)
+			break;
+
+		watch_timer_swap(i, child);
+		i = child;
+	}
+}
+
+static void watch_timer_insert(struct watch_timer *timer)
+{
+	struct watch_timer **heap;
+	unsigned int size;
+
+	if (timer_count == timer_size) {
+		size = timer_size ? timer_size * 2 : 8;
+		heap = realloc(timer_heap, size * sizeof(*heap));
+		if (!heap)
+			err(1, "failed to grow timer heap");
+
+		timer_heap = heap;
+		timer_size = size;
+	}
+
+	timer->index = timer_count;
+	timer_heap[timer_count++] = timer;
+	watch_timer_sift_up(timer->index);
+}
+
+static void watch_timer_delete(struct watch_timer *timer)
+{
+	unsigned int i = timer->index;
+
+	timer_count--;
+	if (i == timer_count)
+		return;
+
+	watch_timer_swap(i, timer_count);
+	watch_timer_sift_down(i);
+	watch_timer_sift_up(i);
+}
+
+static int watch_timer_expired(int fd, void *data);
+
+/**
+ * watch_timer_arm() - program the timerfd for the earliest pending timer
+ *
+ * The timerfd is created, and registered as a read watch, on first use.
+ */
+static void watch_timer_arm(void)
+{
+	struct itimerspec its = {};
+	uint64_t expires;
 	int ret;
 
-	ret = gettimeofday(&now, NULL);
+	if (timer_fd < 0) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0)
+			err(1, "failed to create timerfd");
+
+		watch_add_readfd(timer_fd, watch_timer_expired, NULL, NULL);
+	}
+
+	expires = timer_count ? timer_heap[0]->expires : 0;
+	if (expires == timer_armed)
+		return;
+
+	/* An all-zero it_value disarms the timerfd */
+	its.it_value.tv_sec = expires / 1000000000ULL;
+	its.it_value.tv_nsec = expires % 1000000000ULL;
+
+	ret = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
 	if (ret < 0)
-		err(1, "failed to gettimeofday");
+		err(1, "failed to arm timerfd");
 
-	tv.tv_sec = timer->interval / 1000;
-	tv.tv_usec = (timer->interval % 1000) * 1000;
+	timer_armed = expires;
+}
 
-	timeradd(&now, &tv, &timer->tick);
+static void watch_timer_schedule(struct watch_timer *timer, uint64_t now)
+{
+	timer->expires = now + timer->interval * 1000000ULL;
+	watch_timer_insert(timer);
 }
 
-int watch_add_timer(void (*cb)(void *), void *data, unsigned int interval,
-		    bool repeat)
+/**
+ * watch_add_timer() - register a timer
+ * @cb:		callback to invoke as the timer expires
+ * @data:	private data passed to @cb
+ * @interval:	timeout, in milliseconds
+ * @repeat:	fire every @interval ms, rather than only once
+ *
+ * Return: handle to be passed to watch_cancel_timer(); for a one-shot timer
+ * the handle is only valid until the timer has fired.
+ */
+struct watch_timer *watch_add_timer(void (*cb)(void *), void *data,
+				    unsigned int interval, bool repeat)
 {
-	struct timer *w;
+	struct watch_timer *timer;
 
-	w = calloc(1, sizeof(struct timer));
-	if (!w)
+	timer = calloc(1, sizeof(struct watch_timer));
+	if (!timer)
 		err(1, "calloc");
 
-	w->cb = cb;
-	w->data = data;
-	w->interval = interval;
-	w->repeat = repeat;
-
-	list_add(&timers, &w->node);
+	timer->cb = cb;
+	timer->data = data;
+	timer->interval = interval;
+	timer->repeat = repeat;
 
-	watch_set_timer(w);
+	watch_timer_schedule(timer, watch_now());
+	watch_timer_arm();
 
-	return 0;
+	return timer;
 }
 
-static void watch_free_timer(struct timer *timer)
+/**
+ * watch_cancel_timer() - cancel and release a pending timer
+ * @timer:	timer handle, as returned from watch_add_timer()
+ *
+ * May be called from within the callback of @timer itself.
+ */
+void watch_cancel_timer(struct watch_timer *timer)
 {
-	list_del(&timer->node);
+	if (!timer)
+		return;
+
+	if (timer == timer_running) {
+		timer_cancelled = true;
+		return;
+	}
+
+	watch_timer_delete(timer);
+	watch_timer_arm();
 	free(timer);
 }
 
-static struct timer *watch_get_next_timer()
+/*
+ * Fire every timer that has expired by the time the timerfd is serviced.
+ * Repeating timers are rescheduled relative to the current time, at least
+ * 1ms ahead, so that each fires at most once per wakeup.
+ */
+static int watch_timer_expired(int fd, __attribute__((unused)) void *data)
 {
-	struct timeval tv;
-	struct timer *selected;
-	struct timer *timer;
+	struct watch_timer *timer;
+	uint64_t expirations;
+	uint64_t now;
+	ssize_t n;
 
-	if (list_empty(&timers))
-		return NULL;
+	n = read(fd, &expirations, sizeof(expirations));
+	if (n < 0 && errno != EAGAIN)
+		warn("failed to read timerfd");
+
+	now = watch_now();
+
+	while (timer_count && timer_heap[0]->expires <= now) {
+		timer = timer_heap[0];
+		watch_timer_delete(timer);
+
+		timer_running = timer;
+		timer_cancelled = false;
 
-	selected = container_of(timers.next, struct timer, node);
-	tv = selected->tick;
+		timer->cb(timer->data);
 
-	list_for_each_entry(timer, &timers, node) {
-		if (timercmp(&timer->tick, &tv, <)) {
-			selected = timer;
-			tv = timer->tick;
+		timer_running = NULL;
+
+		if (timer->repeat && !timer_cancelled) {
+			timer->expires = now + MAX(timer->interval, 1U) * 1000000ULL;
+			watch_timer_insert(timer);
+		} else {
+			free(timer);
 		}
 	}
 
-	return selected;
+	/* The timerfd fired, so it's no longer armed */
+	timer_armed = 0;
+	watch_timer_arm();
+
+	return 0;
 }
 
 void watch_quit(void)
@@ -347,44 +975,286 @@ void watch_quit(void)
 	do_watch_quit = true;
 }
 
+static struct watch_req *watch_next_req(struct watch *w)
+{
+	if (w->used == w->depth || io_inflight == WATCH_MAX_INFLIGHT)
+		return NULL;
+
+	return &w->reqs[(w->head + w->used) % w->depth];
+}
+
+static bool watch_queue_empty(struct watch *w)
+{
+	return list_empty(w->queue) &&
+	       (!w->prio_queue || list_empty(w->prio_queue));
+}
+
+static void watch_push_req(struct watch *w, struct watch_req *req,
+			   struct mbuf *mbuf, struct list_head *queue)
+{
+	list_del(&mbuf->node);
+
+	req->w = w;
+	req->mbuf = mbuf;
+	req->queue = queue;
+	req->done = false;
+
+	w->used++;
+	io_inflight++;
+}
+
+static void watch_agg_expired(void *data)
+{
+	struct watch *w = data;
+
+	w->agg_timer = NULL;
+	w->agg_flush = true;
+}
+
+/*
+ * Return the mbuf to submit next from the queues of @w, and in @queue the
+ * queue it's on. The priority queue is drained first; on the regular queue
+ * the leading messages are packed into a new mbuf when aggregation is
+ * enabled, or NULL is returned if they are held back to let the aggregate
+ * fill up.
+ *
+ * The packed messages are released right away, as their data is copied, so
+ * their flow control contexts are credited as the aggregate is formed rather
+ * than as it completes.
+ */
+static struct mbuf *watch_next_mbuf(struct watch *w, struct list_head **queue)
+{
+	struct mbuf *first;
+	struct mbuf *mbuf;
+	struct mbuf *agg;
+	unsigned int count = 0;
+	bool full = false;
+	size_t len = 0;
+
+	if (w->prio_queue && !list_empty(w->prio_queue)) {
+		*queue = w->prio_queue;
+		return list_entry_first(w->prio_queue, struct mbuf, node);
+	}
+
+	*queue = w->queue;
+	first = list_entry_first(w->queue, struct mbuf, node);
+
+	if (!w->agg_size || first->size >= w->agg_size)
+		return first;
+
+	list_for_each_entry(mbuf, w->queue, node) {
+		if (len + mbuf->size > w->agg_size) {
+			full = true;
+			break;
+		}
+
+		len += mbuf->size;
+		count++;
+	}
+
+	if (!full && !w->agg_flush) {
+		if (!w->agg_timer)
+			w->agg_timer = watch_add_timer(watch_agg_expired, w,
+						       w->agg_deadline, false);
+		return NULL;
+	}
+
+	/* The deadline covers everything queued until the queue drains */
+	if (!full)
+		w->agg_flush = false;
+
+	if (count == 1)
+		return first;
+
+	agg = mbuf_alloc_room(0, 0, len);
+	if (!agg)
+		return first;
+
+	while (count--) {
+		mbuf = list_entry_first(w->queue, struct mbuf, node);
+		memcpy(mbuf_put(agg, mbuf->size), mbuf->data, mbuf->size);
+
+		list_del(&mbuf->node);
+		watch_free_write_aio(mbuf, NULL);
+	}
+
+	/* Put the aggregate where the messages were, at the head of the queue */
+	list_add(w->queue->next, &agg->node);
+
+	return agg;
+}
+
 static void watch_submit_aio(aio_context_t ioctx, int evfd, struct watch *w)
 {
-	struct iocb *iocb = &w->iocb;
+	struct list_head *queue;
+	struct watch_req *req;
+	struct iocb *iocb;
 	struct mbuf *mbuf;
 	int ret;
 
-	assert(!w->pending_aio);
+	while (!watch_queue_empty(w)) {
+		req = watch_next_req(w);
+		if (!req)
+			break;
 
-	if (list_empty(w->queue))
-		return;
+		mbuf = watch_next_mbuf(w, &queue);
+		if (!mbuf)
+			break;
 
-	mbuf = list_entry_first(w->queue, struct mbuf, node);
+		iocb = &req->iocb;
+		memset(iocb, 0, sizeof(*iocb));
+		iocb->aio_data = (uintptr_t)req;
+		iocb->aio_fildes = w->fd;
+		iocb->aio_lio_opcode = w->is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+		iocb->aio_buf = (uint64_t)mbuf->data;
+		iocb->aio_nbytes = mbuf->size;
+		iocb->aio_offset = 0;
+		iocb->aio_flags = IOCB_FLAG_RESFD;
+		iocb->aio_resfd = evfd;
+
+		ret = io_submit(ioctx, 1, &iocb);
+		if (ret != 1) {
+			fprintf(stderr, "io_submit failed: %d (%d)\n", ret, errno);
+			break;
+		}
 
-	memset(iocb, 0, sizeof(*iocb));
-	iocb->aio_fildes = w->fd;
-	iocb->aio_lio_opcode = w->is_write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
-	iocb->aio_buf = (uint64_t)mbuf->data;
-	iocb->aio_nbytes = mbuf->size;
-	iocb->aio_offset = 0;
-	iocb->aio_flags = IOCB_FLAG_RESFD;
-	iocb->aio_resfd = evfd;
+		watch_push_req(w, req, mbuf, queue);
+	}
+}
 
-	ret = io_submit(ioctx, 1, &iocb);
-	if (ret != 1)
-		fprintf(stderr, "io_submit failed: %d (%d)\n", ret, errno);
+static void watch_submit_uring(struct watch *w)
+{
+	struct list_head *queue;
+	struct watch_req *req;
+	struct mbuf *mbuf;
+	int ret;
 
-	if (ret == 1) {
-		list_del(&mbuf->node);
-		w->pending_aio = mbuf;
+	while (!watch_queue_empty(w)) {
+		/*
+		 * io_uring may issue requests on files such as FunctionFS
+		 * endpoints from concurrent workers, so they'd no longer reach
+		 * the driver in submission order; keep one in flight
+		 */
+		if (w->used)
+			break;
+
+		req = watch_next_req(w);
+		if (!req)
+			break;
+
+		mbuf = watch_next_mbuf(w, &queue);
+		if (!mbuf)
+			break;
+
+		/* Retried on the next iteration if the submission ring is full */
+		ret = uring_prep_rw(uring, w->fd, w->is_write, mbuf->data,
+				    mbuf->size, (uintptr_t)req);
+		if (ret < 0)
+			break;
+
+		watch_push_req(w, req, mbuf, queue);
+	}
+}
+
+/* Let the stalled watches submit their requests again */
+static void watch_retry_stalled(void *data)
+{
+	struct watch *w;
+
+	list_for_each_entry(w, &aio_watches, node)
+		w->stalled = false;
+
+	retry_pending = false;
+}
+
+/*
+ * Requests failing with -EAGAIN, e.g. on a FunctionFS endpoint which is not
+ * yet enabled, are retried after a short delay rather than being
+ * resubmitted right away, to avoid spinning in the event loop.
+ */
+static void watch_stall(struct watch *w)
+{
+	w->stalled = true;
+
+	if (!retry_pending) {
+		watch_add_timer(watch_retry_stalled, NULL,
+				WATCH_RETRY_INTERVAL, false);
+		retry_pending = true;
+	}
+}
+
+/**
+ * watch_complete_req() - complete a queued I/O request
+ * @req:	the completed request
+ * @res:	result of the request
+ *
+ * Completions are delivered to the watch in submission order, so a request
+ * completing ahead of earlier ones is held until those have completed.
+ */
+static void watch_complete_req(struct watch_req *req, int res)
+{
+	struct watch *w = req->w;
+	struct list_head *requeue_prio = NULL;
+	struct list_head *requeue = NULL;
+	bool orphan = w->removed;
+	struct mbuf *mbuf;
+
+	req->res = res;
+	req->done = true;
+	io_inflight--;
+
+	while (w->used) {
+		req = &w->reqs[w->head];
+		if (!req->done)
+			break;
+
+		mbuf = req->mbuf;
+		res = req->res;
+
+		req->mbuf = NULL;
+		req->done = false;
+		w->head = (w->head + 1) % w->depth;
+		w->used--;
+
+		if (w->removed) {
+			if (w->is_write)
+				watch_free_write_aio(mbuf, NULL);
+			else
+				mbuf_free(mbuf);
+		} else if (res == -EAGAIN) {
+			/* Put the mbufs back in order at the head of their queue */
+			if (!requeue) {
+				requeue = w->queue->next;
+				if (w->prio_queue)
+					requeue_prio = w->prio_queue->next;
+			}
+
+			if (req->queue == w->prio_queue)
+				list_add(requeue_prio, &mbuf->node);
+			else
+				list_add(requeue, &mbuf->node);
+			watch_stall(w);
+		} else {
+			if (!w->is_write && res >= 0)
+				mbuf->offset = res;
+
+			w->aio_complete(mbuf, w->data);
+		}
 	}
+
+	if (orphan && !w->used)
+		list_add(&dead_watches, &w->node);
+}
+
+static void watch_uring_complete(uint64_t user_data, int res)
+{
+	watch_complete_req((struct watch_req *)(uintptr_t)user_data, res);
 }
 
 static void watch_handle_eventfd(int evfd, aio_context_t ioctx)
 {
 	struct io_event ev[32];
-	struct iocb *iocb;
-	struct watch *next;
-	struct watch *w;
+	struct watch_req *req;
 	uint64_t evcnt;
 	ssize_t n;
 	int count;
@@ -396,114 +1266,122 @@ static void watch_handle_eventfd(int evfd, aio_context_t ioctx)
 		return;
 	}
 
-	count = io_getevents(ioctx, 1, 32, ev, NULL);
-	list_for_each_entry_safe(w, next, &aio_watches, node) {
-		for (i = 0; i < count; i++) {
-			iocb = (struct iocb *)ev[i].obj;
-			if (iocb->aio_fildes == w->fd) {
-				assert(w->pending_aio);
-
-				if (ev[i].res == -EAGAIN)
-					continue;
-
-				if (!w->is_write && ev[i].res >= 0)
-					w->pending_aio->offset = ev[i].res;
-
-				w->aio_complete(w->pending_aio, w->data);
-				w->pending_aio = NULL;
+	while (evcnt) {
+		count = io_getevents(ioctx, 1, MIN(evcnt, ARRAY_SIZE(ev)), ev, NULL);
+		if (count <= 0)
+			break;
 
-				// watch_submit_aio(ioctx, evfd, w);
-			}
+		/* Each request carries a pointer back to itself in aio_data */
+		for (i = 0; i < count; i++) {
+			req = (struct watch_req *)(uintptr_t)ev[i].data;
+			watch_complete_req(req, ev[i].res);
 		}
+
+		evcnt -= count;
 	}
 }
 
 void watch_run(void)
 {
-	struct timeval *timeout;
-	struct timer *timer;
-	struct timeval now;
-	struct timeval tv;
+	struct epoll_event events[WATCH_MAX_EVENTS];
+	struct epoll_event ev;
 	aio_context_t ioctx = 0;
-	struct watch *next;
 	struct watch *w;
-	fd_set rfds;
-	int evfd;
-	int nfds;
+	int evfd = -1;
 	int ret;
+	int n;
+	int i;
+
+	if (io_engine == WATCH_IO_URING) {
+		uring = uring_new(WATCH_MAX_INFLIGHT);
+		if (!uring)
+			warn("failed to set up io_uring, falling back to aio");
+	}
 
+	/* Linux AIO also serves the watches needing it with io_uring */
 	evfd = eventfd(0, 0);
 	if (evfd < 0)
 		err(1, "failed to create eventfd");
 
-	ret = io_setup(32, &ioctx);
+	ret = io_setup(WATCH_MAX_INFLIGHT, &ioctx);
 	if (ret < 0)
 		err(1, "failed to initialize aio context");
 
-	while (!do_watch_quit) {
-		FD_ZERO(&rfds);
-		FD_SET(evfd, &rfds);
-
-		nfds = evfd + 1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &aio_notifier;
+	ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD, evfd, &ev);
+	if (ret < 0)
+		err(1, "failed to add I/O completion notifier to epoll");
+
+	if (uring) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &uring_notifier;
+		ret = epoll_ctl(watch_epoll_fd(), EPOLL_CTL_ADD,
+				uring_fd(uring), &ev);
+		if (ret < 0)
+			err(1, "failed to add I/O completion notifier to epoll");
+	}
 
-		list_for_each_entry(w, &read_watches, node) {
-			/* Skip read watches with flows that are blocked */
-			if (watch_flow_blocked(w->flow))
+	while (!do_watch_quit) {
+		list_for_each_entry(w, &aio_watches, node) {
+			if (watch_queue_empty(w) || w->stalled)
 				continue;
 
-			FD_SET(w->fd, &rfds);
-
-			nfds = MAX(w->fd + 1, nfds);
-		}
-
-		list_for_each_entry(w, &aio_watches, node) {
-			/* Submit AIO if none is pending */
-			if (!list_empty(w->queue) && !w->pending_aio)
+			if (uring && !w->use_aio)
+				watch_submit_uring(w);
+			else
 				watch_submit_aio(ioctx, evfd, w);
 		}
 
-		timer = watch_get_next_timer();
-		if (timer) {
-			gettimeofday(&now, NULL);
-			timersub(&timer->tick, &now, &tv);
-
-			if (tv.tv_sec < 0)
-				tv.tv_sec = tv.tv_usec = 0;
-
-			timeout = &tv;
-		} else {
-			timeout = NULL;
+		/* Hand all requests queued above to the kernel at once */
+		if (uring) {
+			ret = uring_submit(uring);
+			if (ret < 0)
+				warnx("io_uring submission failed: %d", ret);
 		}
 
-		ret = select(nfds, &rfds, NULL, NULL, timeout);
-		if (ret < 0) {
-			warn("failed to select");
+		n = epoll_wait(epoll_fd, events, WATCH_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			warn("failed to epoll_wait");
 			break;
 		}
 
-		if (ret == 0 && timer) {
-			timer->cb(timer->data);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == &uring_notifier) {
+				uring_reap(uring, watch_uring_complete);
+				continue;
+			}
 
-			if (timer->repeat)
-				watch_set_timer(timer);
-			else
-				watch_free_timer(timer);
-		}
+			if (events[i].data.ptr == &aio_notifier) {
+				watch_handle_eventfd(evfd, ioctx);
+				continue;
+			}
 
-		if (FD_ISSET(evfd, &rfds))
-			watch_handle_eventfd(evfd, ioctx);
+			w = events[i].data.ptr;
 
-		list_for_each_entry_safe(w, next, &read_watches, node) {
-			if (FD_ISSET(w->fd, &rfds)) {
-				ret = w->cb(w->fd, w->data);
-				if (ret < 0)
-					list_del(&w->node);
-			}
+			/* Skip watches removed or blocked by earlier callbacks */
+			if (w->removed || watch_flow_blocked(w->flow))
+				continue;
+
+			ret = w->cb(w->fd, w->data);
+			if (ret < 0 && !w->removed)
+				watch_remove_read(w);
 		}
+
+		watch_free_dead();
 	}
 
 	list_for_each_entry(w, &quit_watches, node)
 		w->cb(-1, w->data);
 
+	if (uring) {
+		uring_free(uring);
+		uring = NULL;
+	}
+
 	io_destroy(ioctx);
+	close(evfd);
 }
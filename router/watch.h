@@ -32,28 +32,38 @@
 #define __WATCH_H__
 
 #include <stdbool.h>
+#include <stdio.h>
 #include "list.h"
 
 struct mbuf;
 struct watch_flow;
+struct watch_timer;
 
 int watch_add_readfd(int fd, int (*cb)(int, void*), void *data,
 		     struct watch_flow *flow);
 int watch_add_readq(int fd, struct list_head *queue,
 		    int (*cb)(struct mbuf *mbuf, void *data), void *data);
 int watch_add_writeq(int fd, struct list_head *queue);
+int watch_set_queue_depth(int fd, unsigned int depth);
+int watch_use_aio(int fd);
+int watch_set_priority_queue(int fd, struct list_head *queue);
+int watch_set_aggregation(int fd, size_t size, unsigned int deadline);
 void watch_remove_fd(int fd);
 void watch_remove_writeq(int fd);
 int watch_add_quit(int (*cb)(int, void*), void *data);
-int watch_add_timer(void (*cb)(void *), void *data,
-		    unsigned int interval, bool repeat);
+struct watch_timer *watch_add_timer(void (*cb)(void *), void *data,
+				    unsigned int interval, bool repeat);
+void watch_cancel_timer(struct watch_timer *timer);
 void watch_quit(void);
+int watch_set_io_engine(const char *name);
 void watch_run(void);
 
 
 struct watch_flow;
 
 struct watch_flow *watch_flow_new(void);
-void watch_flow_inc(struct watch_flow *flow);
+int watch_flow_set_watermarks(struct watch_flow *flow, size_t high, size_t low);
+void watch_flow_inc(struct watch_flow *flow, size_t bytes);
+void watch_flow_stats(struct watch_flow *flow, FILE *fp, const char *name);
 
 #endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../router/crc16.h"
+
+#define BENCH_BUF_SIZE	(1024 * 1024)
+#define BENCH_ROUNDS	256
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Report the throughput of each HDLC CRC implementation supported by the
+ * CPU, after verifying it against the reference table.
+ */
+int main(void)
+{
+	const struct crc16_impl *impl;
+	volatile uint16_t crc;
+	unsigned int i;
+	uint8_t *buf;
+	double start;
+	double secs;
+	int round;
+
+	buf = malloc(BENCH_BUF_SIZE);
+	if (!buf)
+		err(1, "failed to allocate benchmark buffer");
+
+	for (i = 0; i < BENCH_BUF_SIZE; i++)
+		buf[i] = rand();
+
+	for (i = 0; (impl = crc16_impl_get(i)); i++) {
+		if (!impl->supported()) {
+			printf("%-12s unsupported\n", impl->name);
+			continue;
+		}
+
+		if (crc16_selftest(impl) < 0) {
+			printf("%-12s FAILED self-test\n", impl->name);
+			continue;
+		}
+
+		start = now();
+		for (round = 0; round < BENCH_ROUNDS; round++)
+			crc = impl->update(0xffff, buf, BENCH_BUF_SIZE);
+		secs = now() - start;
+
+		printf("%-12s %6.2f GB/s (crc %04x)\n", impl->name,
+		       (double)BENCH_BUF_SIZE * BENCH_ROUNDS / secs / 1e9,
+		       (uint16_t)~crc);
+	}
+
+	free(buf);
+
+	return 0;
+}
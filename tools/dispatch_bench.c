@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../router/cmd_table.h"
+#include "../router/diag.h"
+
+#define BENCH_RANGES	4096
+#define BENCH_LOOKUPS	(1024 * 1024)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Peripherals are only compared by address */
+static struct peripheral *fake_peripheral(unsigned int i)
+{
+	static char peripherals[8];
+
+	return (struct peripheral *)&peripherals[i % 8];
+}
+
+static size_t linear_lookup(struct diag_cmd *cmds, size_t count,
+			    unsigned int key)
+{
+	size_t matches = 0;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (key < cmds[i].first || key > cmds[i].last)
+			continue;
+
+		matches++;
+	}
+
+	return matches;
+}
+
+/*
+ * Register a few thousand subsystem command ranges, as a set of peripherals
+ * would, verify the indexed lookup against a linear scan and compare their
+ * cost.
+ */
+int main(void)
+{
+	struct cmd_table table = {};
+	struct diag_cmd **matches;
+	struct diag_cmd *cmds;
+	volatile size_t found;
+	unsigned int *keys;
+	unsigned int first;
+	unsigned int dups = 0;
+	size_t count;
+	size_t i;
+	size_t j;
+	double start;
+	double linear;
+	double indexed;
+
+	cmds = calloc(BENCH_RANGES, sizeof(*cmds));
+	keys = malloc(BENCH_LOOKUPS * sizeof(*keys));
+	if (!cmds || !keys)
+		err(1, "failed to allocate benchmark state");
+
+	srand(1);
+	for (i = 0; i < BENCH_RANGES; i++) {
+		first = DIAG_CMD_SUBSYS_DISPATCH << 24 | (rand() & 0xff) << 16 |
+			(rand() & 0xfff);
+
+		cmds[i].first = first;
+		cmds[i].last = first + (rand() & 0x3f);
+		cmds[i].peripheral = fake_peripheral(i);
+
+		cmd_table_add(&table, cmds[i].first, cmds[i].last,
+			      cmds[i].peripheral, NULL);
+	}
+
+	/* Peripherals re-registering their ranges must not add entries */
+	for (i = 0; i < BENCH_RANGES; i += 4) {
+		if (cmd_table_add(&table, cmds[i].first, cmds[i].last,
+				  cmds[i].peripheral, NULL) < 0)
+			dups++;
+	}
+
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		j = rand() % BENCH_RANGES;
+		keys[i] = cmds[j].first + rand() % 0x80;
+	}
+
+	for (i = 0; i < BENCH_LOOKUPS; i += 61) {
+		count = cmd_table_lookup(&table, keys[i], &matches);
+		if (count != linear_lookup(cmds, BENCH_RANGES, keys[i]))
+			errx(1, "lookup mismatch for key 0x%x", keys[i]);
+
+		for (j = 0; j < count; j++) {
+			if (keys[i] < matches[j]->first ||
+			    keys[i] > matches[j]->last)
+				errx(1, "bogus match for key 0x%x", keys[i]);
+		}
+	}
+
+	start = now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found = linear_lookup(cmds, BENCH_RANGES, keys[i]);
+	linear = now() - start;
+
+	start = now();
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		found = cmd_table_lookup(&table, keys[i], &matches);
+	indexed = now() - start;
+
+	(void)found;
+
+	printf("%d ranges, %u duplicate registrations rejected\n",
+	       BENCH_RANGES, dups);
+	printf("%-12s %8.1f ns/lookup\n", "linear",
+	       linear * 1e9 / BENCH_LOOKUPS);
+	printf("%-12s %8.1f ns/lookup\n", "indexed",
+	       indexed * 1e9 / BENCH_LOOKUPS);
+
+	free(keys);
+	free(cmds);
+
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+
+/*
+ * Check that a message broadcast to several DMs survives one of them
+ * dropping its copy: the DMs after it must still be queued the intact
+ * message, and the mbuf pools must come out consistent.
+ */
+
+#include <sys/socket.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../router/diag.h"
+#include "../router/dm.h"
+#include "../router/mbuf.h"
+#include "../router/watch.h"
+
+#define TEST_MSG_SIZE		100
+#define TEST_MAX_QUEUED		8
+
+/* Stand in for the rest of the router, recording what the DMs queue */
+static struct mbuf *queued[TEST_MAX_QUEUED];
+static unsigned int num_queued;
+
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow)
+{
+	if (num_queued == TEST_MAX_QUEUED)
+		errx(1, "too many messages queued");
+
+	queued[num_queued++] = mbuf;
+	list_add(queue, &mbuf->node);
+}
+
+/* Frame as a flag followed by the message, enough to tell reads of stale data */
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen)
+{
+	struct mbuf *mbuf;
+	uint8_t *p;
+
+	mbuf = mbuf_alloc(msglen + 1);
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+
+	p = mbuf_put(mbuf, msglen + 1);
+	p[0] = 0x7e;
+	memcpy(p + 1, msg, msglen);
+
+	return mbuf;
+}
+
+int diag_client_handle_command(struct diag_client *client, uint8_t *data,
+			       size_t len)
+{
+	return 0;
+}
+
+static struct diag_client *test_dm_add(const char *name, bool hdlc,
+				       unsigned int packets)
+{
+	struct diag_client *dm;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		err(1, "failed to create socket pair");
+
+	dm = dm_add(name, -1, sv[0], hdlc, 0);
+	dm_set_queue_limit(dm, 1024 * 1024, packets, DM_DROP_NEWEST);
+	dm_enable(dm);
+
+	return dm;
+}
+
+static void test_release_queued(void)
+{
+	while (num_queued) {
+		struct mbuf *mbuf = queued[--num_queued];
+
+		list_del(&mbuf->node);
+		mbuf_free(mbuf);
+	}
+}
+
+/* A pool handing out the same buffer twice has had it freed twice */
+static int test_pool_consistent(void)
+{
+	struct mbuf *a = mbuf_alloc(TEST_MSG_SIZE);
+	struct mbuf *b = mbuf_alloc(TEST_MSG_SIZE);
+	int ret = a != b ? 0 : -1;
+
+	mbuf_free(a);
+	if (a != b)
+		mbuf_free(b);
+
+	return ret;
+}
+
+static int test_check(const char *name, bool ok)
+{
+	printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+
+	return ok ? 0 : 1;
+}
+
+int main(void)
+{
+	struct diag_client *dropping;
+	struct diag_client *raw;
+	struct diag_client *hdlc;
+	uint8_t msg[TEST_MSG_SIZE];
+	struct mbuf *mbuf;
+	const uint8_t *p;
+	int failed = 0;
+
+	memset(msg, 0x5a, sizeof(msg));
+
+	/* The first raw DM drops everything queued to it */
+	dropping = test_dm_add("dropping", false, 0);
+	raw = test_dm_add("raw", false, TEST_MAX_QUEUED);
+	hdlc = test_dm_add("hdlc", true, TEST_MAX_QUEUED);
+
+	dm_broadcast(msg, sizeof(msg), NULL);
+
+	failed |= test_check("copied broadcast, queued", num_queued == 2);
+	failed |= test_check("copied broadcast, raw intact",
+			     num_queued == 2 && queued[0]->size == sizeof(msg) &&
+			     !memcmp(queued[0]->data, msg, sizeof(msg)));
+	test_release_queued();
+	failed |= test_check("copied broadcast, pool consistent",
+			     !test_pool_consistent());
+
+	mbuf = mbuf_alloc(sizeof(msg));
+	if (!mbuf)
+		err(1, "failed to allocate mbuf");
+	memcpy(mbuf_put(mbuf, sizeof(msg)), msg, sizeof(msg));
+
+	dm_broadcast_mbuf(mbuf, NULL);
+
+	p = num_queued == 2 ? queued[1]->data : NULL;
+	failed |= test_check("mbuf broadcast, queued", num_queued == 2);
+	failed |= test_check("mbuf broadcast, hdlc intact",
+			     p && queued[1]->size == sizeof(msg) + 1 &&
+			     p[0] == 0x7e && !memcmp(p + 1, msg, sizeof(msg)));
+	test_release_queued();
+	failed |= test_check("mbuf broadcast, pool consistent",
+			     !test_pool_consistent());
+
+	dm_stats(stdout);
+
+	(void)raw;
+	(void)hdlc;
+	(void)dropping;
+
+	return failed;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2026, Linaro Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ * may be used to endorse or promote products derived from this software without
+ * specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measure the round trip of command responses through a DM whose output is
+ * saturated with log data: log messages are broadcast faster than the
+ * emulated host link drains them, while responses are sent at a steady
+ * interval. Each message carries its send time, from which the latency of
+ * each class is reported as seen by the reading end.
+ */
+
+#include <sys/socket.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../router/diag.h"
+#include "../router/dm.h"
+#include "../router/mbuf.h"
+#include "../router/watch.h"
+
+#define BENCH_DURATION		5000
+#define BENCH_LINK_RATE		(40 * 1000 * 1000)
+
+#define BENCH_LOG_INTERVAL	1
+#define BENCH_LOG_BURST		64
+#define BENCH_LOG_SIZE		1024
+
+#define BENCH_RESP_INTERVAL	20
+#define BENCH_RESP_SIZE		16
+
+#define BENCH_CMD_LOG		0x10
+#define BENCH_CMD_RESP		0x1d
+
+#define BENCH_MAX_SAMPLES	(1024 * 1024)
+
+struct bench_msg {
+	uint8_t cmd;
+	uint8_t reserved[7];
+	uint64_t sent;
+};
+
+struct bench_samples {
+	const char *name;
+	double *latency;
+	unsigned int count;
+};
+
+static struct bench_samples log_samples = { .name = "log" };
+static struct bench_samples resp_samples = { .name = "response" };
+
+static struct diag_client *bench_dm;
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The benchmark runs the DM alone, so stand in for the rest of the router */
+void queue_push_mbuf(struct list_head *queue, struct mbuf *mbuf,
+		     struct watch_flow *flow)
+{
+	mbuf->flow = flow;
+
+	watch_flow_inc(flow, mbuf->size);
+
+	list_add(queue, &mbuf->node);
+}
+
+struct mbuf *hdlc_encode_mbuf(const void *msg, size_t msglen)
+{
+	errx(1, "HDLC encoding not expected in benchmark");
+}
+
+int diag_client_handle_command(struct diag_client *client, uint8_t *data,
+			       size_t len)
+{
+	return 0;
+}
+
+static void bench_send_logs(void *data)
+{
+	uint8_t buf[BENCH_LOG_SIZE] = {};
+	struct bench_msg *msg = (struct bench_msg *)buf;
+	int i;
+
+	msg->cmd = BENCH_CMD_LOG;
+
+	for (i = 0; i < BENCH_LOG_BURST; i++) {
+		msg->sent = now();
+		dm_broadcast(buf, sizeof(buf), NULL);
+	}
+}
+
+static void bench_send_response(void *data)
+{
+	uint8_t buf[BENCH_RESP_SIZE] = {};
+	struct bench_msg *msg = (struct bench_msg *)buf;
+
+	msg->cmd = BENCH_CMD_RESP;
+	msg->sent = now();
+
+	dm_send(bench_dm, buf, sizeof(buf));
+}
+
+static void bench_stop(void *data)
+{
+	watch_quit();
+}
+
+static void bench_record(struct bench_samples *samples, uint64_t sent,
+			 uint64_t received)
+{
+	if (samples->count == BENCH_MAX_SAMPLES)
+		return;
+
+	samples->latency[samples->count++] = (received - sent) / 1e6;
+}
+
+/* Drain the DM at BENCH_LINK_RATE, as a host behind a bulk link would */
+static void *bench_reader(void *data)
+{
+	struct bench_msg *msg;
+	uint64_t start = now();
+	uint64_t received = 0;
+	uint64_t due;
+	uint64_t t;
+	uint8_t buf[4096];
+	ssize_t n;
+	int fd = (intptr_t)data;
+
+	for (;;) {
+		n = read(fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+
+		t = now();
+		msg = (struct bench_msg *)buf;
+		if (n >= (ssize_t)sizeof(*msg) && msg->cmd == BENCH_CMD_LOG)
+			bench_record(&log_samples, msg->sent, t);
+		else if (n >= (ssize_t)sizeof(*msg) && msg->cmd == BENCH_CMD_RESP)
+			bench_record(&resp_samples, msg->sent, t);
+
+		received += n;
+		due = start + received * 1000000000ULL / BENCH_LINK_RATE;
+		if (due > t) {
+			struct timespec ts = {
+				.tv_sec = (due - t) / 1000000000ULL,
+				.tv_nsec = (due - t) % 1000000000ULL,
+			};
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void bench_report(struct bench_samples *samples)
+{
+	double *l = samples->latency;
+	unsigned int n = samples->count;
+	double sum = 0;
+	unsigned int i;
+
+	if (!n) {
+		printf("%-10s no samples\n", samples->name);
+		return;
+	}
+
+	qsort(l, n, sizeof(*l), bench_cmp);
+	for (i = 0; i < n; i++)
+		sum += l[i];
+
+	printf("%-10s %8u %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+	       samples->name, n, l[0], sum / n, l[n / 2], l[n * 99 / 100],
+	       l[n - 1]);
+}
+
+int main(void)
+{
+	pthread_t reader;
+	int sv[2];
+	int ret;
+
+	log_samples.latency = calloc(BENCH_MAX_SAMPLES, sizeof(double));
+	resp_samples.latency = calloc(BENCH_MAX_SAMPLES, sizeof(double));
+	if (!log_samples.latency || !resp_samples.latency)
+		err(1, "failed to allocate samples");
+
+	ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
+	if (ret < 0)
+		err(1, "failed to create socket pair");
+
+	/* As for the clients of the unix socket */
+	ret = fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	if (ret < 0)
+		err(1, "failed to set O_NONBLOCK");
+
+	bench_dm = dm_add("bench", -1, sv[0], false, 0);
+	dm_enable(bench_dm);
+
+	ret = pthread_create(&reader, NULL, bench_reader, (void *)(intptr_t)sv[1]);
+	if (ret)
+		errx(1, "failed to start reader thread");
+
+	watch_add_timer(bench_send_logs, NULL, BENCH_LOG_INTERVAL, true);
+	watch_add_timer(bench_send_response, NULL, BENCH_RESP_INTERVAL, true);
+	watch_add_timer(bench_stop, NULL, BENCH_DURATION, false);
+
+	watch_run();
+
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(reader, NULL);
+
+	printf("%-10s %8s %10s %10s %10s %10s %10s\n", "class", "count",
+	       "min ms", "avg ms", "p50 ms", "p99 ms", "max ms");
+	bench_report(&resp_samples);
+	bench_report(&log_samples);
+
+	dm_stats(stdout);
+
+	return 0;
+}